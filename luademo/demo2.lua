@@ -27,5 +27,9 @@ function Response(response)
 	-- print(response.body.size)
 	-- print(response.body.text())
 	-- print(response.body.json().name)
+	-- print(response.body.jsonpath('/name'))
+	-- print(response.body.find('"name"'), response.body.sub(1, 16))
+	-- 和 string.find 一样可以传 init, plain: response.body:find('"name"', 1, true)
+	-- print(response.body.startswith('{'), response.body.byte(1), #response.body)
 	return true
 end
\ No newline at end of file
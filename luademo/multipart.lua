@@ -14,5 +14,5 @@ function Preset()
 end
 
 function Response(response)
-	return response.statusCode == 200 and response.body.json().code == 0
+	return response.statusCode == 200 and response.body.jsonpath("/code") == 0
 end
@@ -0,0 +1,26 @@
+-- oo -s ./luademo/request.lua -c 1000 -C 10
+
+-- 每个请求调用一次，ctx.thread 为线程编号，ctx.seq 为本线程的请求序号
+-- 只返回字符串时当作 url，没有返回的字段使用命令行的设置
+-- function Request(ctx)
+-- 	return "http://localhost:7777/item/" .. ctx.seq
+-- end
+
+-- 每 n 个请求调用一次 (--lua-batch，默认 64)，比 Request 少很多次解释器调用
+function RequestBatch(n, ctx)
+	local batch = {}
+	for i = 0, n - 1 do
+		local id = ctx.seq + i
+		batch[i] = {
+			method = "post",
+			url = "http://localhost:7777/item/" .. id,
+			headers = { ["X-Id"] = tostring(id) },
+			body = '{"id":' .. id .. '}',
+		}
+	end
+	return batch
+end
+
+function Response(response)
+	return response.statusCode == 200
+end
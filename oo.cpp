@@ -6,12 +6,33 @@
 #include "oo.h"
 
 #include <atomic>
+#include <charconv>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <latch>
+#include <random>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-std::atomic_size_t requestedCount{0};
-std::atomic_size_t successCount{0};
-std::atomic_size_t errorCount{0};
-std::atomic_size_t respDataCount{0};
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OO_SSE2 1
+#endif
 
 namespace oo {
 /**
@@ -33,6 +54,54 @@ size_t curlRespHeaderCallback(char* buffer, size_t size, size_t nitems,
   return resp->WriteHeader(buffer, nitems * size);
 }
 
+// 不需要 header 和 body 时丢掉 body，返回大小从 curl_easy_getinfo 获取
+size_t curlDiscardCallback([[maybe_unused]] void* data, size_t size,
+                           size_t nmemb, [[maybe_unused]] void* userp) {
+  return size * nmemb;
+}
+
+// 从共享的映射里复制 -dF 文件的内容
+size_t curlUploadReadCallback(char* buffer, size_t size, size_t nitems,
+                              void* arg) {
+  auto pCursor = (UploadCursor*)arg;
+  auto n = min(size * nitems, pCursor->pFile->Size() - pCursor->offset);
+  if (n) memcpy(buffer, pCursor->pFile->Data() + pCursor->offset, n);
+  pCursor->offset += n;
+  return n;
+}
+
+// curl 重发 (重定向、认证等) 时回到开头
+int curlUploadSeekCallback(void* arg, curl_off_t offset, int origin) {
+  auto pCursor = (UploadCursor*)arg;
+  if (origin != SEEK_SET || offset < 0 ||
+      (size_t)offset > pCursor->pFile->Size())
+    return CURL_SEEKFUNC_FAIL;
+  pCursor->offset = (size_t)offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+/**
+ * curl_multi 需要监听的 socket 发生变化时调用
+ * what CURL_POLL_IN/OUT/INOUT/REMOVE
+ */
+int curlMultiSocketCallback([[maybe_unused]] CURL* easy, curl_socket_t s,
+                            int what, void* userp, void* socketp) {
+  auto loop = (MultiLoop*)userp;
+  loop->WatchSocket(s, what, socketp);
+  return 0;
+}
+
+/**
+ * curl_multi 需要的超时时间变化时调用
+ * timeoutMs 为 -1 时删除定时器
+ */
+int curlMultiTimerCallback([[maybe_unused]] CURLM* multi, long timeoutMs,
+                           void* userp) {
+  auto loop = (MultiLoop*)userp;
+  loop->SetTimer(timeoutMs);
+  return 0;
+}
+
 namespace utils {
 string_view trim(string_view src, char ignoreChar = ' ') {
   if (src.empty()) return src;
@@ -46,51 +115,637 @@ string_view trim(string_view src, char ignoreChar = ' ') {
   return string_view(src.data() + begin, end - begin + 1);
 }
 
-void lua_pushjson(lua_State* L, const json& data) {
-  switch (data.type()) {
-    case json::value_t::null:
-      lua_pushnil(L);
-      break;
-    case json::value_t::object: {
-      lua_newtable(L);
-      size_t i = 0;
-      for (auto& [key, value] : data.items()) {
-        lua_pushstring(L, key.c_str());
-        lua_pushjson(L, value);
-        i++;
-        lua_settable(L, -3);
-      }
-      break;
+// "0,2,4-7" => {0,2,4,5,6,7}
+vector<uint32_t> parseCpuList(string_view src) {
+  vector<uint32_t> cpus;
+  while (!src.empty()) {
+    auto end = src.find(',');
+    auto item = trim(src.substr(0, end));
+    src = end == string_view::npos ? string_view() : src.substr(end + 1);
+    if (item.empty()) continue;
+
+    auto dash = item.find('-');
+    uint32_t first = atoi(string(item.substr(0, dash)).c_str());
+    uint32_t last = dash == string_view::npos
+                        ? first
+                        : atoi(string(item.substr(dash + 1)).c_str());
+    for (auto i = first; i <= last; i++) cpus.push_back(i);
+  }
+  return cpus;
+}
+
+bool equalsIgnoreCase(string_view lhs, string_view rhs) {
+  if (lhs.size() != rhs.size()) return false;
+  for (size_t i = 0; i < lhs.size(); i++)
+    if (::tolower((unsigned char)lhs[i]) != ::tolower((unsigned char)rhs[i]))
+      return false;
+  return true;
+}
+
+uint32_t hashIgnoreCase(string_view src) {
+  uint32_t hash = 2166136261u;
+  for (auto c : src) {
+    hash ^= (uint8_t)::tolower((unsigned char)c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+const char* findByte(const char* data, size_t size, char c) {
+  size_t i = 0;
+#ifdef OO_SSE2
+  // 一次比较 16 个字节
+  auto needle = _mm_set1_epi8(c);
+  for (; i + 16 <= size; i += 16) {
+    auto block = _mm_loadu_si128((const __m128i*)(data + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    if (mask) return data + i + countr_zero((uint32_t)mask);
+  }
+#endif
+  for (; i < size; i++)
+    if (data[i] == c) return data + i;
+  return nullptr;
+}
+
+const char* findBytes(const char* data, size_t size, const char* needle,
+                      size_t needleSize) {
+  if (needleSize == 0) return data;
+  if (needleSize > size) return nullptr;
+  if (needleSize == 1) return findByte(data, size, needle[0]);
+
+  size_t last = size - needleSize;  // 最后一个可能的起点
+  size_t i = 0;
+#ifdef OO_SSE2
+  // 同时比较 needle 的首字节和尾字节，两个都命中的位置再 memcmp
+  auto first = _mm_set1_epi8(needle[0]);
+  auto tail = _mm_set1_epi8(needle[needleSize - 1]);
+  for (; i + 16 <= last + 1; i += 16) {
+    auto b1 = _mm_loadu_si128((const __m128i*)(data + i));
+    auto b2 = _mm_loadu_si128((const __m128i*)(data + i + needleSize - 1));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(b1, first), _mm_cmpeq_epi8(b2, tail)));
+    while (mask) {
+      auto pos = i + countr_zero(mask);
+      if (memcmp(data + pos + 1, needle + 1, needleSize - 2) == 0)
+        return data + pos;
+      mask &= mask - 1;
     }
-    case json::value_t::array: {
-      lua_newtable(L);
-      size_t i = 0;
-      for (auto& element : data) {
-        lua_pushinteger(L, i);
-        lua_pushjson(L, element);
-        i++;
-        lua_settable(L, -3);
-      }
-      break;
+  }
+#endif
+  while (i <= last) {
+    auto p = findByte(data + i, last - i + 1, needle[0]);
+    if (p == nullptr) return nullptr;
+    if (memcmp(p, needle, needleSize) == 0) return p;
+    i = p - data + 1;
+  }
+  return nullptr;
+}
+
+// "500ms" "10s" "2m" "1h"，没有单位为秒
+chrono::milliseconds parseDuration(string_view src) {
+  src = trim(src);
+  auto unitPos = src.find_first_not_of("0123456789.");
+  double value = atof(string(src.substr(0, unitPos)).c_str());
+  auto unit = unitPos == string_view::npos ? string_view("s")
+                                           : trim(src.substr(unitPos));
+
+  double ms;
+  if (unit == "ms")
+    ms = value;
+  else if (unit == "s")
+    ms = value * 1000;
+  else if (unit == "m")
+    ms = value * 60 * 1000;
+  else if (unit == "h")
+    ms = value * 60 * 60 * 1000;
+  else {
+    cerr << "Error: duration unit " << unit << endl;
+    exit(1);
+  }
+  return chrono::milliseconds((int64_t)ms);
+}
+
+// "60s:5000,10m:5000,30s:0" => 每个阶段 duration:target
+vector<Stage> parseStages(string_view src) {
+  vector<Stage> stages;
+  while (!src.empty()) {
+    auto end = src.find(',');
+    auto item = trim(src.substr(0, end));
+    src = end == string_view::npos ? string_view() : src.substr(end + 1);
+    if (item.empty()) continue;
+
+    auto colon = item.find(':');
+    if (colon == string_view::npos) {
+      cerr << "Error: stage " << item << " need duration:target" << endl;
+      exit(1);
     }
-    case json::value_t::string:
-      lua_pushstring(L, data.get<std::string>().c_str());
-      break;
-    case json::value_t::boolean:
-      lua_pushboolean(L, data.get<bool>());
-      break;
-    case json::value_t::number_integer:
-      lua_pushinteger(L, data.get<int>());
-      break;
-    case json::value_t::number_unsigned:
-      lua_pushnumber(L, data.get<unsigned int>());
-      break;
-    case json::value_t::number_float:
-      lua_pushnumber(L, data.get<double>());
-      break;
+    stages.push_back({parseDuration(item.substr(0, colon)),
+                      atof(string(item.substr(colon + 1)).c_str())});
+  }
+  return stages;
+}
+
+// "512" "64k" "10MB" "1g"
+size_t parseSize(string_view src) {
+  src = trim(src);
+  auto unitPos = src.find_first_not_of("0123456789.");
+  double value = atof(string(src.substr(0, unitPos)).c_str());
+  if (unitPos == string_view::npos) return (size_t)value;
+
+  switch (::tolower(src[unitPos])) {
+    case 'b':
+      return (size_t)value;
+    case 'k':
+      return (size_t)(value * 1024);
+    case 'm':
+      return (size_t)(value * 1024 * 1024);
+    case 'g':
+      return (size_t)(value * 1024 * 1024 * 1024);
     default:
-      break;
+      cerr << "Error: size unit " << src.substr(unitPos) << endl;
+      exit(1);
+  }
+}
+
+// 进程允许使用的 cpu，去掉 reserve 中的
+vector<uint32_t> availableCpus(const vector<uint32_t>& reserve) {
+  vector<uint32_t> cpus;
+  auto reserved = [&](uint32_t cpu) {
+    return find(reserve.begin(), reserve.end(), cpu) != reserve.end();
+  };
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (uint32_t i = 0; i < CPU_SETSIZE; i++)
+      if (CPU_ISSET(i, &set) && !reserved(i)) cpus.push_back(i);
+  }
+#elif defined(_WIN32)
+  DWORD_PTR processMask, systemMask;
+  if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+    for (uint32_t i = 0; i < sizeof(DWORD_PTR) * 8; i++)
+      if ((processMask >> i) & 1 && !reserved(i)) cpus.push_back(i);
+  }
+#endif
+
+  return cpus;
+}
+
+// tchar = "!" / "#" / "$" / "%" / "&" / "'" / "*" / "+" / "-" / "." /
+//         "^" / "_" / "`" / "|" / "~" / DIGIT / ALPHA
+bool isToken(string_view src) {
+  if (src.empty()) return false;
+  for (auto c : src)
+    if (!isalnum((unsigned char)c) && (!c || !strchr("!#$%&'*+-.^_`|~", c)))
+      return false;
+  return true;
+}
+
+bool pinThread(uint32_t cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+  return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+  return false;
+#endif
+}
+
+// { count, min, max, mean, stdev, p50, p75, p90, p99, p999, p9999 }
+void lua_pushhistogram(lua_State* L, Histogram& histogram) {
+  lua_newtable(L);
+
+  lua_pushstring(L, "count");
+  lua_pushinteger(L, histogram.TotalCount());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "min");
+  lua_pushinteger(L, histogram.Min());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "max");
+  lua_pushinteger(L, histogram.Max());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "mean");
+  lua_pushnumber(L, histogram.Mean());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "stdev");
+  lua_pushnumber(L, histogram.Stdev());
+  lua_settable(L, -3);
+
+  const pair<const char*, double> percentiles[] = {
+      {"p50", 50}, {"p75", 75},    {"p90", 90},
+      {"p99", 99}, {"p999", 99.9}, {"p9999", 99.99},
+  };
+  for (auto&& [name, p] : percentiles) {
+    lua_pushstring(L, name);
+    lua_pushinteger(L, histogram.Percentile(p));
+    lua_settable(L, -3);
+  }
+}
+
+LuaJsonSax::LuaJsonSax(lua_State* L) : L{L} {}
+
+// 刚压入的值放进上一层容器
+bool LuaJsonSax::Store() {
+  if (arrayIndexes.empty()) return true;
+  auto& index = arrayIndexes.back();
+  if (index < 0) {
+    lua_settable(L, -3);  // t[key] = value
+  } else {
+    lua_seti(L, -2, index++);
+  }
+  return true;
+}
+
+bool LuaJsonSax::Open(bool isArray, size_t elements) {
+  if (!lua_checkstack(L, 3)) {
+    error = "json too deep";
+    return false;
+  }
+  auto n = elements == (size_t)-1 ? 0 : (int)min<size_t>(elements, INT_MAX);
+  lua_createtable(L, isArray ? n : 0, isArray ? 0 : n);
+  arrayIndexes.push_back(isArray ? 0 : -1);
+  return true;
+}
+
+bool LuaJsonSax::null() {
+  lua_pushnil(L);
+  return Store();
+}
+
+bool LuaJsonSax::boolean(bool val) {
+  lua_pushboolean(L, val);
+  return Store();
+}
+
+bool LuaJsonSax::number_integer(json::number_integer_t val) {
+  lua_pushinteger(L, (lua_Integer)val);
+  return Store();
+}
+
+bool LuaJsonSax::number_unsigned(json::number_unsigned_t val) {
+  // 放不进 lua_Integer 的才用浮点
+  if (val <= (json::number_unsigned_t)LUA_MAXINTEGER)
+    lua_pushinteger(L, (lua_Integer)val);
+  else
+    lua_pushnumber(L, (lua_Number)val);
+  return Store();
+}
+
+bool LuaJsonSax::number_float(json::number_float_t val, const std::string&) {
+  lua_pushnumber(L, val);
+  return Store();
+}
+
+bool LuaJsonSax::string(json::string_t& val) {
+  lua_pushlstring(L, val.data(), val.size());
+  return Store();
+}
+
+bool LuaJsonSax::binary(json::binary_t&) {
+  lua_pushnil(L);
+  return Store();
+}
+
+bool LuaJsonSax::start_object(size_t elements) { return Open(false, elements); }
+
+bool LuaJsonSax::key(json::string_t& val) {
+  lua_pushlstring(L, val.data(), val.size());
+  return true;
+}
+
+bool LuaJsonSax::end_object() {
+  arrayIndexes.pop_back();
+  return Store();
+}
+
+bool LuaJsonSax::start_array(size_t elements) { return Open(true, elements); }
+
+bool LuaJsonSax::end_array() {
+  arrayIndexes.pop_back();
+  return Store();
+}
+
+bool LuaJsonSax::parse_error(size_t, const std::string&,
+                             const json::exception& ex) {
+  error = ex.what();
+  return false;
+}
+
+bool lua_pushjson(lua_State* L, string_view src, std::string* pError) {
+  LuaJsonSax sax(L);
+  auto top = lua_gettop(L);
+  if (!json::sax_parse(src, &sax) || lua_gettop(L) != top + 1) {
+    lua_settop(L, top);
+    if (pError) *pError = sax.error.empty() ? "invalid json" : sax.error;
+    return false;
   }
+  return true;
+}
+
+JsonDomSax::JsonDomSax(json& result) : dom{result, false} {}
+bool JsonDomSax::null() { return dom.null(); }
+bool JsonDomSax::boolean(bool val) { return dom.boolean(val); }
+bool JsonDomSax::number_integer(json::number_integer_t val) {
+  return dom.number_integer(val);
+}
+bool JsonDomSax::number_unsigned(json::number_unsigned_t val) {
+  return dom.number_unsigned(val);
+}
+bool JsonDomSax::number_float(json::number_float_t val, const std::string& s) {
+  return dom.number_float(val, s);
+}
+bool JsonDomSax::string(json::string_t& val) { return dom.string(val); }
+bool JsonDomSax::binary(json::binary_t& val) { return dom.binary(val); }
+bool JsonDomSax::start_object(size_t elements) {
+  return dom.start_object(elements);
+}
+bool JsonDomSax::key(json::string_t& val) { return dom.key(val); }
+bool JsonDomSax::end_object() { return dom.end_object(); }
+bool JsonDomSax::start_array(size_t elements) {
+  return dom.start_array(elements);
+}
+bool JsonDomSax::end_array() { return dom.end_array(); }
+bool JsonDomSax::parse_error(size_t position, const std::string& lastToken,
+                             const json::exception& ex) {
+  return dom.parse_error(position, lastToken, ex);
+}
+
+JsonScalarEqualSax::JsonScalarEqualSax(const json& expected)
+    : expected{expected} {}
+bool JsonScalarEqualSax::null() {
+  equal = expected.is_null();
+  return true;
+}
+bool JsonScalarEqualSax::boolean(bool val) {
+  equal = expected.is_boolean() && expected.get<bool>() == val;
+  return true;
+}
+// 数字和 json 的 == 一样按数值比较，整数之间不经过 double
+bool JsonScalarEqualSax::number_integer(json::number_integer_t val) {
+  if (expected.is_number_unsigned())
+    equal = val >= 0 &&
+            (json::number_unsigned_t)val == expected.get<json::number_unsigned_t>();
+  else if (expected.is_number_integer())
+    equal = val == expected.get<json::number_integer_t>();
+  else
+    equal = expected.is_number_float() &&
+            (json::number_float_t)val == expected.get<json::number_float_t>();
+  return true;
+}
+bool JsonScalarEqualSax::number_unsigned(json::number_unsigned_t val) {
+  if (expected.is_number_unsigned())
+    equal = val == expected.get<json::number_unsigned_t>();
+  else if (expected.is_number_integer())
+    equal = expected.get<json::number_integer_t>() >= 0 &&
+            val == (json::number_unsigned_t)expected.get<json::number_integer_t>();
+  else
+    equal = expected.is_number_float() &&
+            (json::number_float_t)val == expected.get<json::number_float_t>();
+  return true;
+}
+bool JsonScalarEqualSax::number_float(json::number_float_t val,
+                                      [[maybe_unused]] const std::string& s) {
+  equal = expected.is_number() && val == expected.get<json::number_float_t>();
+  return true;
+}
+bool JsonScalarEqualSax::string(json::string_t& val) {
+  equal = expected.is_string() && expected.get_ref<const json::string_t&>() == val;
+  return true;
+}
+bool JsonScalarEqualSax::binary([[maybe_unused]] json::binary_t& val) {
+  return true;
+}
+// 目标是容器，和标量不可能相等，停止解析
+bool JsonScalarEqualSax::start_object([[maybe_unused]] size_t elements) {
+  return false;
+}
+bool JsonScalarEqualSax::key([[maybe_unused]] json::string_t& val) {
+  return false;
+}
+bool JsonScalarEqualSax::end_object() { return false; }
+bool JsonScalarEqualSax::start_array([[maybe_unused]] size_t elements) {
+  return false;
+}
+bool JsonScalarEqualSax::end_array() { return false; }
+bool JsonScalarEqualSax::parse_error(
+    [[maybe_unused]] size_t position,
+    [[maybe_unused]] const std::string& lastToken,
+    [[maybe_unused]] const json::exception& ex) {
+  return false;
+}
+
+// "/a/0/b~1c" -> { "a", "0", "b/c" }
+bool JsonPointer::Parse(string_view pointer) {
+  tokens.clear();
+  indexes.clear();
+  if (pointer.empty()) return true;
+  if (pointer[0] != '/') return false;
+
+  size_t pos = 1;
+  while (true) {
+    auto end = pointer.find('/', pos);
+    auto raw = pointer.substr(pos, end == string_view::npos ? end : end - pos);
+    std::string token;
+    for (size_t i = 0; i < raw.size(); i++) {
+      if (raw[i] == '~' && i + 1 < raw.size() &&
+          (raw[i + 1] == '0' || raw[i + 1] == '1')) {
+        token.push_back(raw[++i] == '0' ? '~' : '/');
+      } else {
+        token.push_back(raw[i]);
+      }
+    }
+
+    // 数组下标不能有前导 0
+    lua_Integer index = -1;
+    if (!token.empty() && token.size() < 19 &&
+        all_of(token.begin(), token.end(), ::isdigit) &&
+        (token.size() == 1 || token[0] != '0'))
+      index = stoll(token);
+
+    tokens.push_back(move(token));
+    indexes.push_back(index);
+    if (end == string_view::npos) break;
+    pos = end + 1;
+  }
+  return true;
+}
+
+JsonPointerSax::JsonPointerSax(json::json_sax_t* pInner) : pInner{pInner} {}
+
+JsonPointerSax::JsonPointerSax(json::json_sax_t* pInner,
+                               const JsonPointer* pPointer)
+    : pPointer{pPointer}, pInner{pInner} {}
+
+bool JsonPointerSax::SetPointer(string_view pointer) {
+  pPointer = &ownPointer;
+  return ownPointer.Parse(pointer);
+}
+
+/**
+ * 一个值开始时调用，返回这个值是不是目标
+ * pOnPath 返回这个值是否在目标路径上 (容器需要)
+ */
+bool JsonPointerSax::Begin(bool* pOnPath) {
+  bool onPath = true;
+  if (!frames.empty()) {
+    auto& frame = frames.back();
+    if (frame.isArray) {
+      onPath = frame.onPath && frame.index == pPointer->indexes[frames.size() - 1];
+      frame.index++;
+    } else {
+      onPath = keyMatches;
+      keyMatches = false;
+    }
+  }
+  *pOnPath = onPath;
+  return onPath && frames.size() == pPointer->tokens.size();
+}
+
+bool JsonPointerSax::IsTarget() {
+  bool onPath;
+  return Begin(&onPath);
+}
+
+// 目标值已经压入 lua，停止解析
+bool JsonPointerSax::Finish() {
+  found = true;
+  return false;
+}
+
+bool JsonPointerSax::OpenContainer(bool isArray, size_t elements) {
+  if (captureDepth > 0) {
+    captureDepth++;
+    return isArray ? pInner->start_array(elements)
+                   : pInner->start_object(elements);
+  }
+
+  bool onPath;
+  if (Begin(&onPath)) {
+    captureDepth = 1;
+    return isArray ? pInner->start_array(elements)
+                   : pInner->start_object(elements);
+  }
+  // 已经在目标路径之外，不再需要记录下标
+  frames.push_back({isArray, onPath && frames.size() < pPointer->tokens.size(), 0});
+  return true;
+}
+
+bool JsonPointerSax::CloseContainer() {
+  // 目标路径上的容器结束了还没找到，后面不可能再出现目标
+  auto onPath = frames.back().onPath;
+  frames.pop_back();
+  return !onPath;
+}
+
+bool JsonPointerSax::null() {
+  if (captureDepth == 0 && !IsTarget()) return true;
+  pInner->null();
+  return captureDepth > 0 || Finish();
+}
+
+bool JsonPointerSax::boolean(bool val) {
+  if (captureDepth == 0 && !IsTarget()) return true;
+  pInner->boolean(val);
+  return captureDepth > 0 || Finish();
+}
+
+bool JsonPointerSax::number_integer(json::number_integer_t val) {
+  if (captureDepth == 0 && !IsTarget()) return true;
+  pInner->number_integer(val);
+  return captureDepth > 0 || Finish();
+}
+
+bool JsonPointerSax::number_unsigned(json::number_unsigned_t val) {
+  if (captureDepth == 0 && !IsTarget()) return true;
+  pInner->number_unsigned(val);
+  return captureDepth > 0 || Finish();
+}
+
+bool JsonPointerSax::number_float(json::number_float_t val,
+                                  const std::string& s) {
+  if (captureDepth == 0 && !IsTarget()) return true;
+  pInner->number_float(val, s);
+  return captureDepth > 0 || Finish();
+}
+
+bool JsonPointerSax::string(json::string_t& val) {
+  if (captureDepth == 0 && !IsTarget()) return true;
+  pInner->string(val);
+  return captureDepth > 0 || Finish();
+}
+
+bool JsonPointerSax::binary(json::binary_t& val) {
+  if (captureDepth == 0 && !IsTarget()) return true;
+  pInner->binary(val);
+  return captureDepth > 0 || Finish();
+}
+
+bool JsonPointerSax::start_object(size_t elements) {
+  return OpenContainer(false, elements);
+}
+
+bool JsonPointerSax::key(json::string_t& val) {
+  if (captureDepth > 0) return pInner->key(val);
+  auto& frame = frames.back();
+  keyMatches = frame.onPath && val == pPointer->tokens[frames.size() - 1];
+  return true;
+}
+
+bool JsonPointerSax::end_object() {
+  if (captureDepth > 0) {
+    pInner->end_object();
+    return --captureDepth > 0 || Finish();
+  }
+  return CloseContainer();
+}
+
+bool JsonPointerSax::start_array(size_t elements) {
+  return OpenContainer(true, elements);
+}
+
+bool JsonPointerSax::end_array() {
+  if (captureDepth > 0) {
+    pInner->end_array();
+    return --captureDepth > 0 || Finish();
+  }
+  return CloseContainer();
+}
+
+bool JsonPointerSax::parse_error([[maybe_unused]] size_t position,
+                                 [[maybe_unused]] const std::string& lastToken,
+                                 const json::exception& ex) {
+  error = ex.what();
+  return false;
+}
+
+bool lua_pushjsonpointer(lua_State* L, string_view src, string_view pointer,
+                         std::string* pError) {
+  LuaJsonSax inner(L);
+  JsonPointerSax sax(&inner);
+  if (!sax.SetPointer(pointer)) {
+    if (pError) *pError = "invalid json pointer";
+    return false;
+  }
+
+  auto top = lua_gettop(L);
+  json::sax_parse(src, &sax);
+  if (sax.found && lua_gettop(L) == top + 1) return true;
+
+  lua_settop(L, top);
+  if (!sax.error.empty()) {
+    if (pError) *pError = sax.error;
+    return false;
+  }
+  lua_pushnil(L);
+  return true;
 }
 }  // namespace utils
 
@@ -100,13 +755,27 @@ Response::~Response() {
 
 size_t Response::WriteBody(uint8_t* data, size_t size) {
   if (needflag & (uint8_t)NEED_FLAGS::Body) {
-    size_t newSize = body.size + size;
+    // 超过 maxBody 的部分只计数不保存
+    size_t saveSize = size;
+    if (maxBody && body.size + saveSize > maxBody) {
+      saveSize = maxBody - body.size;
+      body.truncated = true;
+    }
+
+    size_t newSize = body.size + saveSize;
+    if (newSize > body.capacity) {
+      // 按倍数增长，避免每一块数据都 realloc
+      size_t newCapacity = max({newSize, body.capacity * 2, (size_t)16 << 10});
+      if (maxBody) newCapacity = min(newCapacity, maxBody);
 
-    auto ptr = (uint8_t*)realloc(body.data, newSize);
-    if (ptr == NULL) return 0; /* 内存不足!，太大可以写入文件 */
+      auto ptr = (uint8_t*)realloc(body.data, newCapacity);
+      if (ptr == NULL) return 0; /* 内存不足!，太大可以写入文件 */
+
+      body.data = ptr;
+      body.capacity = newCapacity;
+    }
 
-    body.data = ptr;
-    memcpy(&(body.data[body.size]), data, size);
+    if (saveSize) memcpy(&(body.data[body.size]), data, saveSize);
     body.size = newSize;
   }
 
@@ -114,60 +783,83 @@ size_t Response::WriteBody(uint8_t* data, size_t size) {
   return size;
 }
 
+/**
+ * curl 每次回调一整行 header
+ * 收到时直接建立索引，遇到新的状态行 (100-continue、重定向) 时丢掉之前的 header
+ */
 size_t Response::WriteHeader(char* buffer, size_t size) {
-  if (needflag & (uint8_t)NEED_FLAGS::Header) headerStr.append(buffer, size);
   this->size += size;
-  return size;
-}
+  if (!(needflag & (uint8_t)NEED_FLAGS::Header)) return size;
 
-map<string_view, string_view, utils::mapComp> Response::GetHeaders() {
-  map<string_view, string_view, utils::mapComp> headerMap;
-  size_t begin{0}, end{0};
-  uint8_t err{0};
+  string_view line{buffer, size};
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+    line.remove_suffix(1);
 
-  auto stepFind = [&](const char c) {
-    end = headerStr.find_first_of(c, begin);
-    if (end == string::npos) {
-      err = 1;
-      return std::string_view("");
-    }
-
-    auto res = string_view(headerStr.data() + begin, end - begin);
-    begin = end + sizeof(char);
-    return res;
-  };
+  if (line.size() >= 5 && line.substr(0, 5) == "HTTP/") {
+    headerStr.clear();
+    headerFields.clear();
+    return size;
+  }
 
-  // Status-Line = HTTP-Version SP Status-Code SP Reason-Phrase CRLF
-  auto httpCersion = stepFind(' ');
-  if (err) return headerMap;
+  auto colon = utils::findByte(line.data(), line.size(), ':');
+  if (colon == nullptr) return size;
 
-  auto statusCode = stepFind(' ');
-  if (err) return headerMap;
+  auto name = utils::trim(line.substr(0, colon - line.data()));
+  auto value = utils::trim(line.substr(colon - line.data() + 1));
+  auto hash = utils::hashIgnoreCase(name);
 
-  auto reasonPhrase = stepFind('\n');
-  if (err) return headerMap;
+  // 只保存需要的 header
+  if (pCaptureHeaders != nullptr && !pCaptureHeaders->empty()) {
+    bool wanted = false;
+    for (auto&& [h, n] : *pCaptureHeaders) {
+      if (h == hash && utils::equalsIgnoreCase(n, name)) {
+        wanted = true;
+        break;
+      }
+    }
+    if (!wanted) return size;
+  }
 
-  // Response Header Fields
-  for (;;) {
-    string_view k = stepFind(':');
-    if (err) break;
+  HeaderField field;
+  field.hash = hash;
+  field.nameOffset = (uint32_t)headerStr.size();
+  field.nameSize = (uint32_t)name.size();
+  headerStr.append(name);
+  field.valueOffset = (uint32_t)headerStr.size();
+  field.valueSize = (uint32_t)value.size();
+  headerStr.append(value);
+  headerFields.push_back(field);
 
-    string_view v = stepFind('\n');
-    if (err) break;
+  return size;
+}
 
-    k = utils::trim(utils::trim(k), '\n');
-    v = utils::trim(utils::trim(v), '\n');
+string_view Response::GetHeader(string_view name) {
+  return GetHeader(utils::hashIgnoreCase(name), name);
+}
 
-    headerMap.insert({k, v});
-  }
-  return headerMap;
+string_view Response::GetHeader(uint32_t hash, string_view name) {
+  for (size_t i = 0; i < headerFields.size(); i++)
+    if (headerFields[i].hash == hash &&
+        utils::equalsIgnoreCase(HeaderName(i), name))
+      return HeaderValue(i);
+  return string_view();
 }
 
 inline void Response::Clear() {
   statusCode = 0;
   headerStr.clear();
+  headerFields.clear();
   body.size = 0;
+  body.truncated = false;
   size = 0;
+  bodySize = 0;
+
+  // 偶尔的大 body 不要一直占着内存
+  if (body.capacity > bodyTrim) {
+    free(body.data);
+    body.data = nullptr;
+    body.capacity = 0;
+  }
 }
 
 Request::Request(int argc, char* argv[]) {
@@ -209,6 +901,66 @@ Request::Request(int argc, char* argv[]) {
       }
       case 'c': {
         requestCount = atoi(argv[++i]);
+        hasRequestCount = true;
+        break;
+      }
+      case 't': {
+        duration = utils::parseDuration(argv[++i]);
+        break;
+      }
+      case 'C': {
+        connections = atoi(argv[++i]);
+        break;
+      }
+      case 'T': {
+        threads = atoi(argv[++i]);
+        break;
+      }
+      case 'R': {
+        rate = atof(argv[++i]);
+        break;
+      }
+      case '-': {
+        if (strcmp(flag, "--hdr") == 0) {
+          hdrPath = argv[++i];
+        } else if (strcmp(flag, "--out") == 0) {
+          outPath = argv[++i];
+        } else if (strcmp(flag, "--arrival") == 0) {
+          poisson = strcmp(argv[++i], "poisson") == 0;
+        } else if (strcmp(flag, "--interval") == 0) {
+          interval = utils::parseDuration(argv[++i]);
+        } else if (strncmp(flag, "--expect-", 9) == 0) {
+          if (strcmp(flag, "--expect-file") == 0)
+            assertions.AddFile(argv[++i]);
+          else
+            assertions.Add(flag + 9, argv[++i]);
+        } else if (strcmp(flag, "--corpus") == 0) {
+          corpusPath = argv[++i];
+        } else if (strcmp(flag, "--replay") == 0) {
+          replayPath = argv[++i];
+        } else if (strcmp(flag, "--replay-speed") == 0) {
+          replaySpeed = atof(argv[++i]);
+        } else if (strcmp(flag, "--corpus-mode") == 0) {
+          corpusShard = strcmp(argv[++i], "shard") == 0;
+        } else if (strcmp(flag, "--lua-batch") == 0) {
+          luaBatch = atoi(argv[++i]);
+        } else if (strcmp(flag, "--lua-gc") == 0) {
+          luaGc = argv[++i];
+        } else if (strcmp(flag, "--lua-gc-step") == 0) {
+          luaGcStep = atoi(argv[++i]);
+        } else if (strcmp(flag, "--resp-header") == 0) {
+          AddResponseHeader(argv[++i]);
+        } else if (strcmp(flag, "--max-body") == 0) {
+          maxBody = utils::parseSize(argv[++i]);
+        } else if (strcmp(flag, "--body-trim") == 0) {
+          bodyTrim = utils::parseSize(argv[++i]);
+        } else if (strcmp(flag, "--stages") == 0) {
+          stages = utils::parseStages(argv[++i]);
+        } else if (strcmp(flag, "--pin") == 0) {
+          pin = true;
+        } else if (strcmp(flag, "--reserve-cpus") == 0) {
+          reserveCpus = utils::parseCpuList(argv[++i]);
+        }
         break;
       }
       case 'm': {
@@ -233,599 +985,3621 @@ Request::Request(int argc, char* argv[]) {
   }
 }
 
-METHOD Request::Method() {
-  if (methodStr == "head") return METHOD::Head;
-  if (methodStr == "get") return METHOD::Get;
-  if (methodStr == "post") return METHOD::Post;
-  if (methodStr == "delete") return METHOD::Delete;
-  if (methodStr == "put") return METHOD::Put;
-  if (methodStr == "patch") return METHOD::Patch;
-  ::exit(1);
-}
+static shared_ptr<vector<string>> loadCsvColumn(string_view file,
+                                                string_view column) {
+  std::ifstream in{string(file)};
+  if (!in) {
+    cerr << "Error: open file " << file << endl;
+    exit(1);
+  }
 
-bool Request::hasScript() {
-  return !this->scirptPath.empty() || !this->scirptCode.empty();
-}
+  // 简单的 csv，支持双引号
+  auto splitRow = [](const string& line) {
+    vector<string> cells{""};
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+      auto c = line[i];
+      if (quoted) {
+        if (c == '"' && i + 1 < line.size() && line[i + 1] == '"')
+          cells.back().push_back(line[++i]);
+        else if (c == '"')
+          quoted = false;
+        else
+          cells.back().push_back(c);
+      } else if (c == '"') {
+        quoted = true;
+      } else if (c == ',') {
+        cells.emplace_back();
+      } else if (c != '\r') {
+        cells.back().push_back(c);
+      }
+    }
+    return cells;
+  };
 
-LuaScript::LuaScript(string_view path, string_view code)
+  // 第一行是列名，column 也可以是从 0 开始的列号
+  string line;
+  getline(in, line);
+  auto names = splitRow(line);
+  size_t index = names.size();
+  for (size_t i = 0; i < names.size(); i++)
+    if (names[i] == column) index = i;
+  if (index == names.size() && !column.empty() &&
+      all_of(column.begin(), column.end(), ::isdigit))
+    index = atoi(string(column).c_str());
+  if (index >= names.size()) {
+    cerr << "Error: csv column " << column << " not in " << file << endl;
+    exit(1);
+  }
+
+  auto values = make_shared<vector<string>>();
+  while (getline(in, line)) {
+    if (line.empty() || line == "\r") continue;
+    auto cells = splitRow(line);
+    values->push_back(index < cells.size() ? move(cells[index]) : string());
+  }
+  if (values->empty()) {
+    cerr << "Error: csv " << file << " has no rows" << endl;
+    exit(1);
+  }
+  return values;
+}
+
+void Template::Compile(string_view src) {
+  segments.clear();
+  auto literal = [this](string_view text) {
+    Segment segment;
+    segment.literal = text;
+    segments.push_back(segment);
+  };
+  auto integer = [](string_view text, int64_t* pValue) {
+    auto [end, ec] = from_chars(text.data(), text.data() + text.size(), *pValue);
+    return ec == errc() && end == text.data() + text.size();
+  };
+
+  size_t pos = 0;
+  while (pos < src.size()) {
+    auto open = src.find("{{", pos);
+    if (open == string_view::npos) break;
+    auto close = src.find("}}", open + 2);
+    if (close == string_view::npos) break;
+
+    if (open > pos) literal(src.substr(pos, open - pos));
+
+    // name:arg1:arg2
+    auto expr = src.substr(open + 2, close - open - 2);
+    vector<string_view> parts;
+    for (size_t start = 0;;) {
+      auto colon = expr.find(':', start);
+      parts.push_back(utils::trim(expr.substr(start, colon - start)));
+      if (colon == string_view::npos) break;
+      start = colon + 1;
+    }
+
+    Segment segment;
+    auto& name = parts[0];
+    int64_t min, max;
+    if (name == "seq" && parts.size() == 1) {
+      segment.kind = Kind::Seq;
+    } else if (name == "uuid" && parts.size() == 1) {
+      segment.kind = Kind::Uuid;
+    } else if (name == "rand" && parts.size() == 3 && integer(parts[1], &min) &&
+               integer(parts[2], &max)) {
+      segment.kind = Kind::Rand;
+      if (max < min) swap(min, max);
+      segment.min = min;
+      // 无符号计算宽度，INT64_MIN:INT64_MAX 回绕成 0，表示整个 64 位范围
+      segment.range = (uint64_t)max - (uint64_t)min + 1;
+    } else if (name == "csv" && parts.size() == 3) {
+      segment.kind = Kind::Csv;
+      segment.column = loadCsvColumn(parts[1], parts[2]);
+    } else {
+      // 不认识的 {{...}} 原样发送，json body 或者其他模板语法不受影响
+      // 只跳过一个 {，里面还可以有占位符，例如 {{"id":{{seq}}}}
+      literal(src.substr(open, 1));
+      pos = open + 1;
+      continue;
+    }
+    segments.push_back(segment);
+    pos = close + 2;
+  }
+  if (pos < src.size()) literal(src.substr(pos));
+}
+
+void Template::Expand(TemplateState* pState, string* pOut) const {
+  char buf[40];
+  for (auto&& it : segments) {
+    switch (it.kind) {
+      case Kind::Literal:
+        pOut->append(it.literal);
+        break;
+      case Kind::Seq: {
+        auto r = to_chars(buf, buf + sizeof(buf), pState->seq);
+        pOut->append(buf, r.ptr - buf);
+        break;
+      }
+      case Kind::Rand: {
+        // range 为 0 表示整个 64 位范围
+        auto n = it.range ? pState->Next() % it.range : pState->Next();
+        auto r = to_chars(buf, buf + sizeof(buf),
+                          (int64_t)((uint64_t)it.min + n));
+        pOut->append(buf, r.ptr - buf);
+        break;
+      }
+      case Kind::Uuid: {
+        // uuid v4
+        static const char hex[] = "0123456789abcdef";
+        uint64_t hi = pState->Next(), lo = pState->Next();
+        hi = (hi & ~0xf000ull) | 0x4000ull;
+        lo = (lo & ~(3ull << 62)) | (2ull << 62);
+        char* p = buf;
+        for (int i = 0; i < 16; i++) {
+          auto byte = (uint8_t)((i < 8 ? hi >> (56 - i * 8) : lo >> (120 - i * 8)));
+          if (i == 4 || i == 6 || i == 8 || i == 10) *p++ = '-';
+          *p++ = hex[byte >> 4];
+          *p++ = hex[byte & 0xf];
+        }
+        pOut->append(buf, p - buf);
+        break;
+      }
+      case Kind::Csv:
+        // 同一个请求里的 csv 使用同一行
+        pOut->append((*it.column)[pState->seq % it.column->size()]);
+        break;
+    }
+  }
+}
+
+void RequestTemplates::Compile(Request* pRequest) {
+  auto has = [](string_view src) {
+    return src.find("{{") != string_view::npos;
+  };
+
+  if (has(pRequest->url)) {
+    url.Compile(pRequest->url);
+    hasUrlSlots = url.HasSlots();
+  }
+  if (has(pRequest->data)) {
+    data.Compile(pRequest->data);
+    hasDataSlots = data.HasSlots();
+  }
+  for (auto&& [k, v] : pRequest->headers)
+    if (has(v)) hasHeaderSlots = true;
+  if (hasHeaderSlots) {
+    for (auto&& [k, v] : pRequest->headers) {
+      headers.push_back({k, Template{}});
+      headers.back().second.Compile(v);
+    }
+  }
+  active = hasUrlSlots || hasDataSlots || hasHeaderSlots;
+}
+
+MappedFile::~MappedFile() { Close(); }
+
+bool MappedFile::Open(string_view path) {
+  Close();
+#ifdef _WIN32
+  hFile = CreateFileA(string(path).c_str(), GENERIC_READ, FILE_SHARE_READ,
+                      NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    hFile = nullptr;
+    return false;
+  }
+  LARGE_INTEGER fileSize;
+  GetFileSizeEx(hFile, &fileSize);
+  size = (size_t)fileSize.QuadPart;
+  if (size == 0) return true;
+  hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (hMapping == nullptr) return false;
+  data = (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+  return data != nullptr;
+#else
+  int fd = open(string(path).c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  size = (size_t)st.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  auto p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    size = 0;
+    return false;
+  }
+  data = (const char*)p;
+  return true;
+#endif
+}
+
+void MappedFile::Close() {
+#ifdef _WIN32
+  if (data != nullptr) UnmapViewOfFile(data);
+  if (hMapping != nullptr) CloseHandle(hMapping);
+  if (hFile != nullptr) CloseHandle(hFile);
+  hMapping = hFile = nullptr;
+#else
+  if (data != nullptr) munmap((void*)data, size);
+#endif
+  data = nullptr;
+  size = 0;
+}
+
+// 去掉行首尾的空白和 \r\n
+static string_view trimLine(string_view line) {
+  auto begin = line.find_first_not_of(" \t\r\n");
+  if (begin == string::npos) return string_view(line.data(), 0);
+  auto end = line.find_last_not_of(" \t\r\n");
+  return line.substr(begin, end - begin + 1);
+}
+
+/**
+ * 大文件按线程数切成几段，每段从下一个换行开始，并行找出行首
+ */
+void Corpus::Index(string_view path, uint32_t threadCount) {
+  if (!file.Open(path)) {
+    cerr << "Error: open " << path << endl;
+    exit(1);
+  }
+
+  auto data = file.Data();
+  auto size = file.Size();
+  const size_t minPart = 64 << 20;
+  size_t parts = clamp<size_t>(size / minPart, 1, max(threadCount, 1u));
+
+  vector<size_t> starts(parts + 1, size);
+  starts[0] = 0;
+  for (size_t i = 1; i < parts; i++) {
+    auto p = utils::findByte(data + size / parts * i,
+                             size - size / parts * i, '\n');
+    starts[i] = p ? p - data + 1 : size;
+  }
+
+  // 空行跳过，每一行记录 [开始, 下一行开始)
+  vector<vector<uint64_t>> lines(parts);
+  auto scan = [&](size_t part) {
+    auto& out = lines[part];
+    size_t pos = starts[part], end = max(starts[part], starts[part + 1]);
+    while (pos < end) {
+      auto p = utils::findByte(data + pos, end - pos, '\n');
+      size_t next = p ? p - data + 1 : end;
+      auto line = trimLine(string_view(data + pos, next - pos));
+      if (!line.empty()) out.push_back(pos);
+      pos = next;
+    }
+  };
+
+  vector<thread> threads;
+  for (size_t i = 1; i < parts; i++) threads.push_back(thread(scan, i));
+  scan(0);
+  for (auto&& it : threads) it.join();
+
+  size_t total = 0;
+  for (auto&& it : lines) total += it.size();
+  offsets.reserve(total + 1);
+  for (auto&& it : lines) offsets.insert(offsets.end(), it.begin(), it.end());
+  offsets.push_back(size);
+
+  if (Size() == 0) {
+    cerr << "Error: " << path << " is empty" << endl;
+    exit(1);
+  }
+}
+
+string_view Corpus::Line(size_t index) const {
+  auto start = offsets[index];
+  auto p = utils::findByte(file.Data() + start, offsets[index + 1] - start,
+                           '\n');
+  auto end = p ? p - file.Data() : offsets[index + 1];
+  return trimLine(string_view(file.Data() + start, end - start));
+}
+
+// 只处理语料需要的 json：对象、字符串，其他值跳过
+namespace {
+struct CorpusScanner {
+  string_view src;
+  size_t pos{0};
+  deque<string>* pScratch;
+
+  void Ws() {
+    while (pos < src.size() && (src[pos] == ' ' || src[pos] == '\t' ||
+                                src[pos] == '\r' || src[pos] == '\n'))
+      pos++;
+  }
+  bool Eat(char c) {
+    Ws();
+    if (pos < src.size() && src[pos] == c) {
+      pos++;
+      return true;
+    }
+    return false;
+  }
+
+  static void AppendUtf8(string* pOut, uint32_t cp) {
+    if (cp < 0x80) {
+      pOut->push_back((char)cp);
+    } else if (cp < 0x800) {
+      pOut->push_back((char)(0xc0 | (cp >> 6)));
+      pOut->push_back((char)(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+      pOut->push_back((char)(0xe0 | (cp >> 12)));
+      pOut->push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+      pOut->push_back((char)(0x80 | (cp & 0x3f)));
+    } else {
+      pOut->push_back((char)(0xf0 | (cp >> 18)));
+      pOut->push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+      pOut->push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+      pOut->push_back((char)(0x80 | (cp & 0x3f)));
+    }
+  }
+
+  bool Hex4(size_t at, uint32_t* pValue) {
+    if (at + 4 > src.size()) return false;
+    uint32_t v = 0;
+    for (size_t i = at; i < at + 4; i++) {
+      auto c = src[i];
+      v <<= 4;
+      if (c >= '0' && c <= '9') v |= c - '0';
+      else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+      else return false;
+    }
+    *pValue = v;
+    return true;
+  }
+
+  // 没有转义时直接返回映射里的内容
+  bool String(string_view* pOut) {
+    if (!Eat('"')) return false;
+    auto start = pos;
+    bool escaped = false;
+    while (pos < src.size() && src[pos] != '"') {
+      if (src[pos] == '\\') {
+        escaped = true;
+        pos++;
+      }
+      pos++;
+    }
+    if (pos >= src.size()) return false;
+    auto raw = src.substr(start, pos - start);
+    pos++;
+    if (!escaped) {
+      *pOut = raw;
+      return true;
+    }
+
+    auto& out = pScratch->emplace_back();
+    out.reserve(raw.size());
+    for (size_t i = 0; i < raw.size(); i++) {
+      if (raw[i] != '\\') {
+        out.push_back(raw[i]);
+        continue;
+      }
+      auto c = raw[++i];
+      switch (c) {
+        case 'n': out.push_back('\n'); break;
+        case 't': out.push_back('\t'); break;
+        case 'r': out.push_back('\r'); break;
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'u': {
+          // 代理对必须是 D800-DBFF 后面跟 DC00-DFFF，否则不是合法的 UTF-8
+          uint32_t cp, low;
+          if (i + 4 >= raw.size() || !Hex4(start + i + 1, &cp)) return false;
+          i += 4;
+          if (cp >= 0xdc00 && cp < 0xe000) return false;
+          if (cp >= 0xd800 && cp < 0xdc00) {
+            if (i + 6 >= raw.size() || raw[i + 1] != '\\' ||
+                raw[i + 2] != 'u' || !Hex4(start + i + 3, &low) ||
+                low < 0xdc00 || low >= 0xe000)
+              return false;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            i += 6;
+          }
+          AppendUtf8(&out, cp);
+          break;
+        }
+        case '"':
+        case '\\':
+        case '/':
+          out.push_back(c);
+          break;
+        default:
+          return false;
+      }
+    }
+    *pOut = out;
+    return true;
+  }
+
+  bool Number(double* pValue) {
+    Ws();
+    auto [end, ec] =
+        from_chars(src.data() + pos, src.data() + src.size(), *pValue);
+    if (ec != errc()) return false;
+    pos = end - src.data();
+    return true;
+  }
+
+  bool Skip() {
+    Ws();
+    if (pos >= src.size()) return false;
+    string_view ignored;
+    if (src[pos] == '"') return String(&ignored);
+    if (src[pos] == '{' || src[pos] == '[') {
+      int depth = 0;
+      while (pos < src.size()) {
+        auto c = src[pos];
+        if (c == '"') {
+          if (!String(&ignored)) return false;
+          continue;
+        }
+        if (c == '{' || c == '[') depth++;
+        if (c == '}' || c == ']') depth--;
+        pos++;
+        if (depth == 0) return true;
+      }
+      return false;
+    }
+    while (pos < src.size() && src[pos] != ',' && src[pos] != '}' &&
+           src[pos] != ']')
+      pos++;
+    return true;
+  }
+};
+}  // namespace
+
+bool parseRequestLine(string_view line, RequestSpec* pSpec,
+                      deque<string>* pScratch, double* pTs) {
+  pSpec->method = pSpec->url = pSpec->body = string_view();
+  pSpec->hasBody = false;
+  pSpec->headers.clear();
+
+  CorpusScanner scanner{line, 0, pScratch};
+  if (!scanner.Eat('{')) return false;
+  if (scanner.Eat('}')) return true;
+  do {
+    string_view key, value;
+    if (!scanner.String(&key) || !scanner.Eat(':')) return false;
+
+    if (key == "method" || key == "url" || key == "body") {
+      if (!scanner.String(&value)) return false;
+      if (key == "method") pSpec->method = value;
+      if (key == "url") pSpec->url = value;
+      if (key == "body") {
+        pSpec->body = value;
+        pSpec->hasBody = true;
+      }
+    } else if (key == "headers") {
+      if (!scanner.Eat('{')) return false;
+      if (!scanner.Eat('}')) {
+        do {
+          string_view k, v;
+          if (!scanner.String(&k) || !scanner.Eat(':') || !scanner.String(&v))
+            return false;
+          pSpec->headers.push_back({k, v});
+        } while (scanner.Eat(','));
+        if (!scanner.Eat('}')) return false;
+      }
+    } else if (key == "ts" && pTs != nullptr) {
+      if (!scanner.Number(pTs)) return false;
+    } else if (!scanner.Skip()) {
+      return false;
+    }
+  } while (scanner.Eat(','));
+  return scanner.Eat('}');
+}
+
+/**
+ * 把 n 行分给几个线程检查，返回最前面的错误行，全部正确返回 SIZE_MAX
+ * 发送时不会再因为格式错误退出
+ */
+static size_t firstInvalidLine(size_t n, uint32_t threadCount,
+                               const function<bool(size_t)>& valid) {
+  size_t parts = clamp<size_t>(n / 65536, 1, max(threadCount, 1u));
+  vector<size_t> invalid(parts, SIZE_MAX);
+  auto check = [&](size_t part) {
+    for (size_t i = n * part / parts; i < n * (part + 1) / parts; i++) {
+      if (!valid(i)) {
+        invalid[part] = i;
+        return;
+      }
+    }
+  };
+
+  vector<thread> threads;
+  for (size_t i = 1; i < parts; i++) threads.push_back(thread(check, i));
+  check(0);
+  for (auto&& it : threads) it.join();
+  return *min_element(invalid.begin(), invalid.end());
+}
+
+void Corpus::Load(string_view path, uint32_t threadCount) {
+  Index(path, threadCount);
+
+  auto bad = firstInvalidLine(Size(), threadCount, [this](size_t i) {
+    thread_local RequestSpec spec;
+    thread_local deque<string> scratch;
+    scratch.clear();
+    return parseRequestLine(Line(i), &spec, &scratch) &&
+           (spec.method.empty() || utils::isToken(spec.method));
+  });
+  if (bad != SIZE_MAX) {
+    cerr << "Error: invalid corpus line " << bad + 1 << endl;
+    exit(1);
+  }
+}
+
+void Corpus::Parse(size_t index, RequestSpec* pSpec,
+                   deque<string>* pScratch) const {
+  if (!parseRequestLine(Line(index), pSpec, pScratch)) {
+    cerr << "Error: invalid corpus line " << index + 1 << endl;
+    exit(1);
+  }
+}
+
+// [10/Oct/2000:13:55:36 -0700] => unix 秒
+static bool parseLogTime(string_view src, double* pTs) {
+  static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  if (src.size() < 20 || src[2] != '/' || src[6] != '/' || src[11] != ':')
+    return false;
+
+  auto number = [&](size_t pos, size_t len, int* pValue) {
+    auto [end, ec] = from_chars(src.data() + pos, src.data() + pos + len, *pValue);
+    return ec == errc() && end == src.data() + pos + len;
+  };
+
+  int day, year, hour, minute, second;
+  if (!number(0, 2, &day) || !number(7, 4, &year) || !number(12, 2, &hour) ||
+      !number(15, 2, &minute) || !number(18, 2, &second))
+    return false;
+  auto pMonth = strstr(months, string(src.substr(3, 3)).c_str());
+  if (pMonth == nullptr || (pMonth - months) % 3) return false;
+  unsigned month = (unsigned)(pMonth - months) / 3 + 1;
+
+  auto days = chrono::sys_days(chrono::year(year) / chrono::month(month) /
+                               chrono::day(day))
+                  .time_since_epoch()
+                  .count();
+  double ts = days * 86400.0 + hour * 3600 + minute * 60 + second;
+
+  // 时区 +0800
+  auto zone = utils::trim(src.substr(20));
+  int offset;
+  if (zone.size() == 5 && (zone[0] == '+' || zone[0] == '-') &&
+      from_chars(zone.data() + 1, zone.data() + 5, offset).ec == errc()) {
+    int seconds = offset / 100 * 3600 + offset % 100 * 60;
+    ts -= zone[0] == '+' ? seconds : -seconds;
+  }
+
+  *pTs = ts;
+  return true;
+}
+
+bool parseReplayLine(string_view line, RequestSpec* pSpec,
+                     deque<string>* pScratch, double* pTs) {
+  if (!line.empty() && line[0] == '{') {
+    if (pTs != nullptr) *pTs = NAN;
+    return parseRequestLine(line, pSpec, pScratch, pTs) &&
+           (pTs == nullptr || !isnan(*pTs));
+  }
+
+  pSpec->method = pSpec->url = pSpec->body = string_view();
+  pSpec->hasBody = false;
+  pSpec->headers.clear();
+
+  auto timeBegin = line.find('[');
+  auto timeEnd = line.find(']', timeBegin);
+  if (timeBegin == string_view::npos || timeEnd == string_view::npos)
+    return false;
+  if (pTs != nullptr &&
+      !parseLogTime(line.substr(timeBegin + 1, timeEnd - timeBegin - 1), pTs))
+    return false;
+
+  // "GET /path HTTP/1.1"
+  auto reqBegin = line.find('"', timeEnd);
+  auto reqEnd = line.find('"', reqBegin + 1);
+  if (reqBegin == string_view::npos || reqEnd == string_view::npos)
+    return false;
+  auto request = line.substr(reqBegin + 1, reqEnd - reqBegin - 1);
+  auto space = request.find(' ');
+  if (space == string_view::npos) return false;
+  pSpec->method = request.substr(0, space);
+  auto path = request.substr(space + 1);
+  pSpec->url = path.substr(0, path.find(' '));
+  return !pSpec->url.empty();
+}
+
+// 并行解析时间戳并检查每一行，格式错误时报告最前面的一行
+void Replay::Load(string_view path, uint32_t threadCount) {
+  lines.Index(path, threadCount);
+  auto n = lines.Size();
+  timestamps.resize(n);
+
+  // 方法名在这里检查，发送时不会再因为日志内容退出
+  auto bad = firstInvalidLine(n, threadCount, [this](size_t i) {
+    thread_local RequestSpec spec;
+    thread_local deque<string> scratch;
+    scratch.clear();
+    return parseReplayLine(lines.Line(i), &spec, &scratch, &timestamps[i]) &&
+           (spec.method.empty() || utils::isToken(spec.method));
+  });
+  if (bad != SIZE_MAX) {
+    cerr << "Error: invalid replay line " << bad + 1 << endl;
+    exit(1);
+  }
+}
+
+METHOD Request::Method() { return parseMethod(methodStr); }
+
+void Request::MapUploads() {
+  for (auto&& it : multipart) {
+    if (!it.isFilePath) continue;
+    for (auto&& value : it.values) {
+      auto [pos, inserted] = uploads.try_emplace(value);
+      if (inserted && !pos->second.Open(value)) {
+        cerr << "Error: open file " << value << endl;
+        exit(1);
+      }
+    }
+  }
+}
+
+METHOD parseMethod(string_view src) {
+  if (utils::equalsIgnoreCase(src, "head")) return METHOD::Head;
+  if (utils::equalsIgnoreCase(src, "get")) return METHOD::Get;
+  if (utils::equalsIgnoreCase(src, "post")) return METHOD::Post;
+  if (utils::equalsIgnoreCase(src, "delete")) return METHOD::Delete;
+  if (utils::equalsIgnoreCase(src, "put")) return METHOD::Put;
+  if (utils::equalsIgnoreCase(src, "patch")) return METHOD::Patch;
+  return METHOD::Custom;
+}
+
+void Request::AddResponseHeader(string_view name) {
+  responseHeaders.push_back({utils::hashIgnoreCase(name), string(name)});
+}
+
+void Assertions::Add(string_view kind, string_view arg) {
+  specs.push_back({string(kind), string(arg)});
+}
+
+/**
+ * {
+ *   "status": [200, "3xx"],
+ *   "header": { "Content-Type": "application/json" },
+ *   "headerRegex": { "X-Request-Id": "^[0-9a-f]+$" },
+ *   "bodyContains": ["ok"],
+ *   "bodySize": "1:64k",
+ *   "json": { "/code": 0 }
+ * }
+ */
+void Assertions::AddFile(string_view path) {
+  std::ifstream in{string(path)};
+  json config = json::parse(in, nullptr, false);
+  if (!in || config.is_discarded() || !config.is_object()) {
+    cerr << "Error: invalid expect file " << path << endl;
+    exit(1);
+  }
+
+  auto asText = [](const json& v) {
+    return v.is_string() ? v.get<string>() : v.dump();
+  };
+
+  for (auto& [kind, value] : config.items()) {
+    if (kind == "status") {
+      string codes;
+      for (auto& it : value.is_array() ? value : json::array({value}))
+        codes += asText(it) + ",";
+      Add("status", codes);
+    } else if (kind == "header" || kind == "headerRegex") {
+      for (auto& [name, v] : value.items())
+        Add(kind == "header" ? "header" : "header-regex", name + ":" + asText(v));
+    } else if (kind == "bodyContains") {
+      for (auto& it : value.is_array() ? value : json::array({value}))
+        Add("body", asText(it));
+    } else if (kind == "bodySize") {
+      Add("size", asText(value));
+    } else if (kind == "json") {
+      for (auto& [pointer, v] : value.items()) Add("json", pointer + "=" + v.dump());
+    } else {
+      cerr << "Error: unknown expect " << kind << endl;
+      exit(1);
+    }
+  }
+}
+
+/**
+ * 每个断言编译成一个 predicate，需要的参数都在这里算好
+ * 需要 header 的断言会把 header 加到 --resp-header 的列表里
+ */
+void Assertions::Compile(vector<pair<uint32_t, string>>* pCaptureHeaders) {
+  predicates.clear();
+
+  auto fail = [](const string& kind, const string& arg) {
+    cerr << "Error: invalid --expect-" << kind << " " << arg << endl;
+    exit(1);
+  };
+
+  for (auto&& [kind, arg] : specs) {
+    if (kind == "status") {
+      // 200,201,3xx
+      hasStatus = true;
+      auto allowed = make_shared<array<bool, 600>>();
+      string_view rest{arg};
+      while (!rest.empty()) {
+        auto code = utils::trim(rest.substr(0, rest.find(',')));
+        rest = rest.find(',') == string_view::npos
+                   ? string_view()
+                   : rest.substr(rest.find(',') + 1);
+        if (code.empty()) continue;
+        if (code.size() == 3 && (code[1] == 'x' || code[1] == 'X') &&
+            code[1] == code[2] && code[0] >= '1' && code[0] <= '5') {
+          auto base = (code[0] - '0') * 100;
+          fill_n(allowed->begin() + base, 100, true);
+        } else {
+          auto n = atoi(string(code).c_str());
+          if (n < 100 || n > 599) fail(kind, arg);
+          (*allowed)[n] = true;
+        }
+      }
+      predicates.push_back([allowed](Response* pResp) {
+        return pResp->statusCode >= 0 && pResp->statusCode < 600 &&
+               (*allowed)[pResp->statusCode];
+      });
+    } else if (kind == "header" || kind == "header-regex") {
+      // Name: value
+      auto colon = arg.find(':');
+      if (colon == string::npos) fail(kind, arg);
+      auto name = string(utils::trim(string_view(arg).substr(0, colon)));
+      auto value = string(utils::trim(string_view(arg).substr(colon + 1)));
+      auto hash = utils::hashIgnoreCase(name);
+      needflag |= (uint8_t)NEED_FLAGS::Header;
+      if (!pCaptureHeaders->empty()) pCaptureHeaders->push_back({hash, name});
+
+      if (kind == "header") {
+        predicates.push_back([hash, name, value](Response* pResp) {
+          auto v = pResp->GetHeader(hash, name);
+          return v.data() != nullptr && v == value;
+        });
+      } else {
+        auto re = make_shared<regex>(value, regex::ECMAScript | regex::optimize);
+        predicates.push_back([hash, name, re](Response* pResp) {
+          auto v = pResp->GetHeader(hash, name);
+          return v.data() != nullptr && regex_search(v.begin(), v.end(), *re);
+        });
+      }
+    } else if (kind == "body") {
+      needflag |= (uint8_t)NEED_FLAGS::Body;
+      predicates.push_back([needle = arg](Response* pResp) {
+        // 空 needle 在空 body 里也算找到
+        if (needle.empty()) return true;
+        return utils::findBytes((char*)pResp->body.data, pResp->body.size,
+                                needle.data(), needle.size()) != nullptr;
+      });
+    } else if (kind == "size") {
+      // min:max，两边都可以省略，只有一个数时为精确大小
+      auto colon = arg.find(':');
+      auto left = utils::trim(string_view(arg).substr(0, colon));
+      auto right = colon == string::npos
+                       ? left
+                       : utils::trim(string_view(arg).substr(colon + 1));
+      size_t minSize = left.empty() ? 0 : utils::parseSize(left);
+      size_t maxSize = right.empty() ? SIZE_MAX : utils::parseSize(right);
+      predicates.push_back([minSize, maxSize](Response* pResp) {
+        return pResp->bodySize >= minSize && pResp->bodySize <= maxSize;
+      });
+    } else if (kind == "json") {
+      // /pointer=value，value 不是 json 时当作字符串
+      auto eq = arg.find('=');
+      if (eq == string::npos) fail(kind, arg);
+      auto pointer = arg.substr(0, eq);
+      auto expected = json::parse(arg.substr(eq + 1), nullptr, false);
+      if (expected.is_discarded()) expected = arg.substr(eq + 1);
+
+      // pointer 和期望值只解析一次，多个线程共享只读
+      auto pPointer = make_shared<utils::JsonPointer>();
+      if (!pPointer->Parse(pointer)) fail(kind, arg);
+
+      needflag |= (uint8_t)NEED_FLAGS::Body;
+      if (expected.is_structured()) {
+        // 期望值是对象或数组时才构建 json 比较
+        predicates.push_back([pPointer, expected](Response* pResp) {
+          json value;
+          utils::JsonDomSax dom(value);
+          utils::JsonPointerSax sax(&dom, pPointer.get());
+          json::sax_parse(
+              string_view((char*)pResp->body.data, pResp->body.size), &sax);
+          return sax.found && value == expected;
+        });
+      } else {
+        predicates.push_back([pPointer, expected](Response* pResp) {
+          utils::JsonScalarEqualSax cmp(expected);
+          utils::JsonPointerSax sax(&cmp, pPointer.get());
+          json::sax_parse(
+              string_view((char*)pResp->body.data, pResp->body.size), &sax);
+          return sax.found && cmp.equal;
+        });
+      }
+    } else {
+      cerr << "Error: unknown --expect-" << kind << endl;
+      exit(1);
+    }
+  }
+}
+
+bool Request::hasScript() {
+  return !this->scirptPath.empty() || !this->scirptCode.empty();
+}
+
+// 标准库，base 和 string (字符串方法) 总是打开，其他在脚本里出现名字时才打开
+static const struct {
+  const char* name;
+  lua_CFunction open;
+} luaLibs[] = {
+    {LUA_GNAME, luaopen_base},          {LUA_STRLIBNAME, luaopen_string},
+    {LUA_TABLIBNAME, luaopen_table},    {LUA_MATHLIBNAME, luaopen_math},
+    {LUA_IOLIBNAME, luaopen_io},        {LUA_OSLIBNAME, luaopen_os},
+    {LUA_UTF8LIBNAME, luaopen_utf8},    {LUA_COLIBNAME, luaopen_coroutine},
+    {LUA_DBLIBNAME, luaopen_debug},     {LUA_LOADLIBNAME, luaopen_package},
+};
+
+static bool hasIdentifier(string_view src, string_view name) {
+  auto isIdent = [](char c) { return c == '_' || ::isalnum((unsigned char)c); };
+  for (auto pos = src.find(name); pos != string_view::npos;
+       pos = src.find(name, pos + 1)) {
+    auto end = pos + name.size();
+    if ((pos == 0 || !isIdent(src[pos - 1])) &&
+        (end == src.size() || !isIdent(src[end])))
+      return true;
+  }
+  return false;
+}
+
+static uint32_t detectLuaLibs(string_view src) {
+  uint32_t libs = 0b11;
+  for (size_t i = 2; i < size(luaLibs); i++)
+    if (hasIdentifier(src, luaLibs[i].name)) libs |= 1u << i;
+  if (hasIdentifier(src, "require")) libs |= 1u << (size(luaLibs) - 1);
+  return libs;
+}
+
+static string readLuaSource(string_view path) {
+  std::ifstream in{string(path), ios::binary};
+  if (!in) {
+    cerr << "load lua file error" << endl;
+    exit(1);
+  }
+  return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static int luaWriteBytecode([[maybe_unused]] lua_State* L, const void* p,
+                            size_t size, void* ud) {
+  ((string*)ud)->append((const char*)p, size);
+  return 0;
+}
+
+LuaPool::~LuaPool() {
+  for (auto it : chunks) free(it);
+}
+
+void* LuaPool::Malloc(size_t size) {
+  if (size > maxClassSize) return malloc(size);
+
+  auto index = ClassIndex(size);
+  if (auto p = freeLists[index]) {
+    freeLists[index] = *(void**)p;
+    return p;
+  }
+
+  // 从当前 chunk 切一块，chunk 用完时剩下的部分不再使用
+  auto classSize = (index + 1) * classStep;
+  if (chunkPos == nullptr || (size_t)(chunkEnd - chunkPos) < classSize) {
+    auto chunk = (char*)malloc(chunkSize);
+    if (chunk == nullptr) return nullptr;
+    chunks.push_back(chunk);
+    chunkPos = chunk;
+    chunkEnd = chunk + chunkSize;
+  }
+  auto p = chunkPos;
+  chunkPos += classSize;
+  return p;
+}
+
+void LuaPool::Free(void* ptr, size_t size) {
+  if (size > maxClassSize) return free(ptr);
+
+  auto index = ClassIndex(size);
+  *(void**)ptr = freeLists[index];
+  freeLists[index] = ptr;
+}
+
+// lua 释放和 realloc 时会给出原来的大小，不需要额外的块头
+void* LuaPool::Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+  auto pool = (LuaPool*)ud;
+  if (nsize == 0) {
+    if (ptr) pool->Free(ptr, osize);
+    return nullptr;
+  }
+  if (ptr == nullptr) return pool->Malloc(nsize);
+
+  if (osize > maxClassSize && nsize > maxClassSize) return realloc(ptr, nsize);
+  if (osize <= maxClassSize && nsize <= maxClassSize &&
+      ClassIndex(osize) == ClassIndex(nsize))
+    return ptr;
+
+  auto p = pool->Malloc(nsize);
+  if (p == nullptr) return nullptr;
+  memcpy(p, ptr, min(osize, nsize));
+  pool->Free(ptr, osize);
+  return p;
+}
+
+static int luaPanic(lua_State* L) {
+  auto msg = lua_tostring(L, -1);
+  cerr << "lua error: " << (msg ? msg : "unknown") << endl;
+  return 0;  // abort
+}
+
+void LuaScript::NewState() {
+  L = lua_newstate(LuaPool::Alloc, &pool);
+  lua_atpanic(L, luaPanic);
+  OpenLibs();
+}
+
+LuaScript::LuaScript(string_view path, string_view code)
     : path{path}, code{code} {
-  L = luaL_newstate();
-  luaL_openlibs(L);
+  // 编译一次，工作线程复制时直接用字节码
+  auto source = !code.empty() ? string(code) : readLuaSource(path);
+  libs = detectLuaLibs(source);
+
+  NewState();
+
+  auto chunkname = !code.empty() ? string("=-sc") : "@" + string(path);
+  if (luaL_loadbufferx(L, source.data(), source.size(), chunkname.c_str(),
+                       "t") != LUA_OK) {
+    cerr << "load lua " << (!code.empty() ? "code" : "file")
+         << " error: " << lua_tostring(L, -1) << endl;
+    exit(1);
+  }
+  auto dump = make_shared<string>();
+  lua_dump(L, luaWriteBytecode, dump.get(), 0);
+  lua_pop(L, 1);
+  bytecode = move(dump);
+}
+
+LuaScript::LuaScript(const LuaScript* pMain)
+    : path{pMain->path},
+      code{pMain->code},
+      libs{pMain->libs},
+      bytecode{pMain->bytecode} {
+  NewState();
+}
+
+void LuaScript::OpenLibs() {
+  for (size_t i = 0; i < size(luaLibs); i++) {
+    if (!(libs & (1u << i))) continue;
+    luaL_requiref(L, luaLibs[i].name, luaLibs[i].open, 1);
+    lua_pop(L, 1);
+  }
+}
+
+LuaScript::~LuaScript() { lua_close(L); }
+
+static bool hasGlobalFunc(lua_State* L, const char* name) {
+  lua_getglobal(L, name);
+  auto ok = lua_isfunction(L, -1) == 1;
+  lua_pop(L, 1);
+  return ok;
+}
+
+bool LuaScript::HasResponseFunc() { return hasGlobalFunc(L, "Response"); }
+
+bool LuaScript::HasIntervalFunc() { return hasGlobalFunc(L, "Interval"); }
+
+bool LuaScript::HasRunDoneFunc() { return hasGlobalFunc(L, "RunDone"); }
+
+bool LuaScript::HasRequestFunc() {
+  return hasGlobalFunc(L, "RequestBatch") || hasGlobalFunc(L, "Request");
+}
+
+// response 和 body 的 userdata 里只有一个指向 pCurrentResponse 的指针
+static inline Response* luaCurrentResponse(lua_State* L, int index) {
+  return **(Response***)lua_touserdata(L, index);
+}
+
+// body 的方法既可以 body.find(x) 也可以 body:find(x)
+static inline int luaBodyArg(lua_State* L) {
+  return lua_rawequal(L, 1, lua_upvalueindex(1)) ? 2 : 1;
+}
+
+// 和 string.sub 一样处理负数和越界，返回 [start, end) 的 0 基位置
+static inline void luaBodyRange(lua_State* L, int arg, size_t size,
+                                size_t* pStart, size_t* pEnd) {
+  auto i = luaL_optinteger(L, arg, 1);
+  auto j = luaL_optinteger(L, arg + 1, -1);
+  auto n = (lua_Integer)size;
+  if (i < 0) i = max<lua_Integer>(n + i + 1, 1);
+  if (i == 0) i = 1;
+  if (i > n + 1) i = n + 1;
+  if (j < 0) j = n + j + 1;
+  if (j > n) j = n;
+  *pStart = (size_t)(i - 1);
+  *pEnd = i > j ? *pStart : (size_t)j;
+}
+
+// body.text() 只有这里会把整个 body 变成 lua string
+int lua_bodyText(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+
+  // 设置 lua 函数返回值
+  lua_pushlstring(L, (char*)pResponse->body.data, pResponse->body.size);
+  return 1;
+}
+
+/**
+ * body.json() 解析失败返回 nil, 错误信息
+ * 结果缓存在 body 的 user value 1，同一次 Response 里不会重复解析
+ */
+int lua_bodyJson(lua_State* L) {
+  if (lua_getiuservalue(L, lua_upvalueindex(1), 1) != LUA_TNIL) return 1;
+  lua_pop(L, 1);
+
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+  string error;
+  if (!utils::lua_pushjson(
+          L, string_view((char*)pResponse->body.data, pResponse->body.size),
+          &error)) {
+    lua_pushnil(L);
+    lua_pushlstring(L, error.data(), error.size());
+    return 2;
+  }
+
+  lua_pushvalue(L, -1);
+  lua_setiuservalue(L, lua_upvalueindex(1), 1);
+  return 1;
+}
+
+// body.jsonpath("/data/0/id") 只解析到目标值为止，没有时返回 nil
+static int lua_bodyJsonPath(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+  size_t pointerSize;
+  auto pointer = luaL_checklstring(L, luaBodyArg(L), &pointerSize);
+  string error;
+  if (!utils::lua_pushjsonpointer(
+          L, string_view((char*)pResponse->body.data, pResponse->body.size),
+          string_view(pointer, pointerSize), &error)) {
+    lua_pushnil(L);
+    lua_pushlstring(L, error.data(), error.size());
+    return 2;
+  }
+  return 1;
+}
+
+// body.len()
+static int lua_bodyLen(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+  lua_pushinteger(L, pResponse->body.size);
+  return 1;
+}
+
+// body.find(needle [, init [, plain]]) 和 string.find 一样的参数
+// 总是按字节查找，plain 只是为了兼容 string.find 的写法，会被忽略
+// 返回 1 基的 start, end，没找到为 nil
+static int lua_bodyFind(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+  auto arg = luaBodyArg(L);
+  size_t needleSize;
+  auto needle = luaL_checklstring(L, arg, &needleSize);
+  // 空 body 的 data 可能是 nullptr，空 needle 要能返回起点
+  auto data = pResponse->body.data ? (const char*)pResponse->body.data : "";
+  auto size = pResponse->body.size;
+
+  auto n = (lua_Integer)size;
+  auto init = luaL_optinteger(L, arg + 1, 1);
+  if (init < 0) init = max<lua_Integer>(n + init + 1, 1);
+  if (init == 0) init = 1;
+  if (init > n + 1) {
+    lua_pushnil(L);
+    return 1;
+  }
+  auto start = (size_t)(init - 1);
+  auto p = utils::findBytes(data + start, size - start, needle, needleSize);
+  if (p == nullptr) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushinteger(L, p - data + 1);
+  lua_pushinteger(L, p - data + needleSize);
+  return 2;
+}
+
+// body.sub(i [, j]) 只把这一段变成 lua string
+static int lua_bodySub(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+  size_t start, end;
+  luaBodyRange(L, luaBodyArg(L), pResponse->body.size, &start, &end);
+  lua_pushlstring(L, (char*)pResponse->body.data + start, end - start);
+  return 1;
+}
+
+// body.byte(i [, j]) 默认 j = i
+static int lua_bodyByte(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+  auto arg = luaBodyArg(L);
+  auto i = luaL_optinteger(L, arg, 1);
+  if (lua_isnoneornil(L, arg + 1)) {
+    lua_settop(L, arg);
+    lua_pushinteger(L, i);
+  }
+  size_t start, end;
+  luaBodyRange(L, arg, pResponse->body.size, &start, &end);
+  auto n = (int)(end - start);
+  luaL_checkstack(L, n, "body.byte: too many results");
+  for (size_t k = start; k < end; k++)
+    lua_pushinteger(L, pResponse->body.data[k]);
+  return n;
+}
+
+// body.startswith(prefix)
+static int lua_bodyStartsWith(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, lua_upvalueindex(1));
+  size_t prefixSize;
+  auto prefix = luaL_checklstring(L, luaBodyArg(L), &prefixSize);
+  lua_pushboolean(L, prefixSize <= pResponse->body.size &&
+                         memcmp(pResponse->body.data, prefix, prefixSize) == 0);
+  return 1;
+}
+
+// #body
+static int lua_bodyLenMeta(lua_State* L) {
+  lua_pushinteger(L, luaCurrentResponse(L, 1)->body.size);
+  return 1;
+}
+
+/**
+ * body.__index
+ * body 只是当前 Response 的视图，不复制内容
+ * upvalue 1: 方法表
+ */
+static int lua_bodyIndex(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, 1);
+  size_t len;
+  auto key = lua_tolstring(L, 2, &len);
+  string_view k{key ? key : "", key ? len : 0};
+
+  if (k == "size") {
+    lua_pushinteger(L, pResponse->body.size);
+  } else if (k == "truncated") {
+    // 超过 --max-body 的部分没有保存
+    lua_pushboolean(L, pResponse->body.truncated);
+  } else {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+  }
+  return 1;
+}
+
+/**
+ * response.__index
+ * upvalue 1: body
+ * user value 1: 本次请求的 headers 表，第一次访问时才创建
+ */
+static int lua_responseIndex(lua_State* L) {
+  auto pResponse = luaCurrentResponse(L, 1);
+  size_t len;
+  auto key = lua_tolstring(L, 2, &len);
+  string_view k{key ? key : "", key ? len : 0};
+
+  if (k == "statusCode") {
+    lua_pushinteger(L, pResponse->statusCode);
+  } else if (k == "size") {
+    lua_pushinteger(L, pResponse->size);
+  } else if (k == "body") {
+    lua_pushvalue(L, lua_upvalueindex(1));
+  } else if (k == "headers") {
+    if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {
+      lua_pop(L, 1);
+      lua_createtable(L, 0, (int)pResponse->HeaderCount());
+      for (size_t i = 0; i < pResponse->HeaderCount(); i++) {
+        auto k = pResponse->HeaderName(i);
+        auto v = pResponse->HeaderValue(i);
+        lua_pushlstring(L, k.data(), k.size());
+        lua_pushlstring(L, v.data(), v.size());
+        lua_settable(L, -3);  // set k/v to headers
+      }
+      lua_pushvalue(L, -1);
+      lua_setiuservalue(L, 1, 1);
+    }
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// 只在第一次调用 Response 时创建，之后每次请求复用
+void LuaScript::PrepareResponse() {
+  lua_getglobal(L, "Response");
+  if (!lua_isfunction(L, -1)) {
+    cerr << "Error: "
+         << "script not Response function" << endl;
+    exit(1);
+  }
+  responseFuncRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  // body
+  auto pb = (Response***)lua_newuserdatauv(L, sizeof(Response**), 1);
+  *pb = &pCurrentResponse;
+  lua_createtable(L, 0, 2);  // metatable
+
+  const pair<const char*, lua_CFunction> bodyMethods[] = {
+      {"text", lua_bodyText},
+      {"json", lua_bodyJson},
+      {"jsonpath", lua_bodyJsonPath},
+      {"len", lua_bodyLen},
+      {"find", lua_bodyFind},
+      {"sub", lua_bodySub},
+      {"byte", lua_bodyByte},
+      {"startswith", lua_bodyStartsWith},
+  };
+  lua_createtable(L, 0, size(bodyMethods));
+  for (auto&& [name, fn] : bodyMethods) {
+    lua_pushvalue(L, -3);  // body
+    lua_pushcclosure(L, fn, 1);
+    lua_setfield(L, -2, name);
+  }
+  lua_pushcclosure(L, lua_bodyIndex, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, lua_bodyLenMeta);
+  lua_setfield(L, -2, "__len");
+  lua_setmetatable(L, -2);
+
+  // response
+  auto pr = (Response***)lua_newuserdatauv(L, sizeof(Response**), 1);
+  *pr = &pCurrentResponse;
+  lua_createtable(L, 0, 1);
+  lua_pushvalue(L, -3);
+  lua_pushcclosure(L, lua_responseIndex, 1);
+  lua_setfield(L, -2, "__index");
+  lua_setmetatable(L, -2);
+  responseObjRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  bodyObjRef = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+bool LuaScript::CallResponse(Response* pResponse) {
+  if (responseFuncRef == LUA_NOREF) PrepareResponse();
+  pCurrentResponse = pResponse;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, responseFuncRef);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, responseObjRef);
+
+  // 清掉上一次请求的 headers 表和 json 缓存
+  lua_pushnil(L);
+  lua_setiuservalue(L, -2, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, bodyObjRef);
+  lua_pushnil(L);
+  lua_setiuservalue(L, -2, 1);
+  lua_pop(L, 1);
+
+  // 调用函数，1个参数，1个返回值
+  auto start = chrono::steady_clock::now();
+  lua_call(L, 1, 1);  // call lua Response function
+  callTime += chrono::steady_clock::now() - start;
+
+  // 获取返回值
+  auto ok = lua_toboolean(L, -1);  // get lua Response function return value
+  lua_pop(L, 1);
+
+  return ok;
+}
+
+void LuaScript::CallRunDone(RunResult* result) {
+  if (!HasRunDoneFunc()) {
+    cerr << "Error: "
+         << "script not RunDone function" << endl;
+    exit(1);
+  }
+
+  // 获取函数
+  lua_getglobal(L, "RunDone");
+
+  // 设置函数参数 result
+  lua_newtable(L);
+
+  // 设置 result.threadCount
+  lua_pushstring(L, "threadCount");
+  lua_pushinteger(L, result->threadCount);
+  lua_settable(L, -3);
+
+  // 设置 result.connectionCount
+  lua_pushstring(L, "connectionCount");
+  lua_pushinteger(L, result->connectionCount);
+  lua_settable(L, -3);
+
+  // 设置 result.respDataCount
+  lua_pushstring(L, "respDataCount");
+  lua_pushinteger(L, result->respDataCount);
+  lua_settable(L, -3);
+
+  // 设置 result.successCount
+  lua_pushstring(L, "successCount");
+  lua_pushinteger(L, result->successCount);
+  lua_settable(L, -3);
+
+  // 设置 result.errorCount
+  lua_pushstring(L, "errorCount");
+  lua_pushinteger(L, result->errorCount);
+  lua_settable(L, -3);
+
+  // 设置 result.timeMs
+  lua_pushstring(L, "timeMs");
+  lua_pushinteger(L, result->time.count());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "setupUs");
+  lua_pushinteger(L, result->setupTime.count());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "luaUs");
+  lua_pushinteger(L, result->luaTime.count());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "luaGcUs");
+  lua_pushinteger(L, result->gcTime.count());
+  lua_settable(L, -3);
+
+  // 设置 result.latency = { p50, p99, ... }，单位微秒
+  lua_pushstring(L, "latency");
+  utils::lua_pushhistogram(L, result->latency);
+  lua_settable(L, -3);
+
+  // 设置 result.phases = { dns = {...}, connect = {...}, ... }，单位微秒
+  lua_pushstring(L, "phases");
+  lua_newtable(L);
+  for (auto&& [name, pHistogram] : result->phases.Items()) {
+    lua_pushstring(L, name);
+    utils::lua_pushhistogram(L, *pHistogram);
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  // 设置 result.rate/lateCount/droppedCount 开环模式
+  lua_pushstring(L, "rate");
+  lua_pushnumber(L, result->rate);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "lateCount");
+  lua_pushinteger(L, result->lateCount);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "droppedCount");
+  lua_pushinteger(L, result->droppedCount);
+  lua_settable(L, -3);
+
+  // 设置 result.scheduleLag 开环和回放模式实际发出比计划晚多少，单位微秒
+  lua_pushstring(L, "scheduleLag");
+  utils::lua_pushhistogram(L, result->scheduleLag);
+  lua_settable(L, -3);
+
+  // 设置 result.statusCodes = { [200] = 10, ... }
+  lua_pushstring(L, "statusCodes");
+  lua_newtable(L);
+  for (auto&& [code, count] : result->statusCounts) {
+    lua_pushinteger(L, code);
+    lua_pushinteger(L, count);
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  // 设置 result.connectCount 新建的连接数
+  lua_pushstring(L, "connectCount");
+  lua_pushinteger(L, result->connectCount);
+  lua_settable(L, -3);
+
+  // 设置 result.stages = { {durationMs, target, requestedCount, latency...} }
+  lua_pushstring(L, "stages");
+  lua_newtable(L);
+  for (size_t i = 0; i < result->stages.size(); i++) {
+    auto& it = result->stages[i];
+    lua_pushinteger(L, i);
+    lua_newtable(L);
+
+    lua_pushstring(L, "durationMs");
+    lua_pushinteger(L, it.duration.count());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "elapsedMs");
+    lua_pushinteger(L, it.elapsed.count());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "target");
+    lua_pushnumber(L, it.target);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "requestedCount");
+    lua_pushinteger(L, it.requestedCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "successCount");
+    lua_pushinteger(L, it.successCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "errorCount");
+    lua_pushinteger(L, it.errorCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "respDataCount");
+    lua_pushinteger(L, it.respDataCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "rps");
+    lua_pushnumber(L, it.Rps());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "latency");
+    utils::lua_pushhistogram(L, it.latency);
+    lua_settable(L, -3);
+
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  // 设置 result.intervals = { {timeMs, rps, errorRate, p99...}, ... }
+  lua_pushstring(L, "intervals");
+  lua_newtable(L);
+  for (size_t i = 0; i < result->intervals.size(); i++) {
+    auto& it = result->intervals[i];
+    lua_pushinteger(L, i);
+    lua_newtable(L);
+
+    lua_pushstring(L, "timeMs");
+    lua_pushinteger(L, it.time.count());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "intervalMs");
+    lua_pushinteger(L, it.interval.count());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "requestedCount");
+    lua_pushinteger(L, it.requestedCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "errorCount");
+    lua_pushinteger(L, it.errorCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "rps");
+    lua_pushnumber(L, it.Rps());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "errorRate");
+    lua_pushnumber(L, it.ErrorRate());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "bytesPerSecond");
+    lua_pushnumber(L, it.BytesPerSecond());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "p50");
+    lua_pushinteger(L, it.p50);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "p99");
+    lua_pushinteger(L, it.p99);
+    lua_settable(L, -3);
+
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  // 设置 result.threads = { {cpu, requestedCount, rps, ...}, ... }
+  lua_pushstring(L, "threads");
+  lua_newtable(L);
+  for (size_t i = 0; i < result->threads.size(); i++) {
+    auto& it = result->threads[i];
+    lua_pushinteger(L, i);
+    lua_newtable(L);
+
+    lua_pushstring(L, "cpu");
+    lua_pushinteger(L, it.cpu);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "connectionCount");
+    lua_pushinteger(L, it.connectionCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "requestedCount");
+    lua_pushinteger(L, it.requestedCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "successCount");
+    lua_pushinteger(L, it.successCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "errorCount");
+    lua_pushinteger(L, it.errorCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "respDataCount");
+    lua_pushinteger(L, it.respDataCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "connectCount");
+    lua_pushinteger(L, it.connectCount);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "timeMs");
+    lua_pushinteger(L, it.time.count());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "setupUs");
+    lua_pushinteger(L, it.setupTime.count());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "rps");
+    lua_pushnumber(L, it.Rps());
+    lua_settable(L, -3);
+
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  // 调用函数，1个参数，0个返回值
+  lua_call(L, 1, 0);
+}
+
+void LuaScript::CallInterval(IntervalSnapshot* pSnapshot) {
+  lua_getglobal(L, "Interval");
+
+  // 设置函数参数 snapshot
+  lua_newtable(L);
+
+  lua_pushstring(L, "timeMs");
+  lua_pushinteger(L, pSnapshot->time.count());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "intervalMs");
+  lua_pushinteger(L, pSnapshot->interval.count());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "requestedCount");
+  lua_pushinteger(L, pSnapshot->requestedCount);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "successCount");
+  lua_pushinteger(L, pSnapshot->successCount);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "errorCount");
+  lua_pushinteger(L, pSnapshot->errorCount);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "respDataCount");
+  lua_pushinteger(L, pSnapshot->respDataCount);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "rps");
+  lua_pushnumber(L, pSnapshot->Rps());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "errorRate");
+  lua_pushnumber(L, pSnapshot->ErrorRate());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "bytesPerSecond");
+  lua_pushnumber(L, pSnapshot->BytesPerSecond());
+  lua_settable(L, -3);
+
+  // snapshot.latency 微秒
+  lua_pushstring(L, "latency");
+  lua_newtable(L);
+
+  lua_pushstring(L, "count");
+  lua_pushinteger(L, pSnapshot->latencyCount);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "mean");
+  lua_pushnumber(L, pSnapshot->latencyMean);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "max");
+  lua_pushinteger(L, pSnapshot->latencyMax);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "p50");
+  lua_pushinteger(L, pSnapshot->p50);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "p90");
+  lua_pushinteger(L, pSnapshot->p90);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "p99");
+  lua_pushinteger(L, pSnapshot->p99);
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "p999");
+  lua_pushinteger(L, pSnapshot->p999);
+  lua_settable(L, -3);
+
+  lua_settable(L, -3);
+
+  // 调用函数，1个参数，0个返回值
+  lua_call(L, 1, 0);
+}
+
+void LuaScript::PresetRequestVariable(Request* pRequest) {
+  // 全局变量 request table
+  lua_newtable(L);
+
+  lua_pushstring(L, "method");
+  lua_pushlstring(L, pRequest->methodStr.data(), pRequest->methodStr.size());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "url");
+  lua_pushlstring(L, pRequest->url.data(), pRequest->url.size());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "requestCount");
+  lua_pushinteger(L, pRequest->requestCount);
+  lua_settable(L, -3);
+
+  // 秒
+  lua_pushstring(L, "duration");
+  lua_pushnumber(L, pRequest->duration.count() / 1000.0);
+  lua_settable(L, -3);
+
+  // stages = { {duration = 秒, target = 0}, ... }
+  lua_pushstring(L, "stages");
+  lua_newtable(L);
+  for (size_t i = 0; i < pRequest->stages.size(); i++) {
+    lua_pushinteger(L, i);
+    lua_newtable(L);
+
+    lua_pushstring(L, "duration");
+    lua_pushnumber(L, pRequest->stages[i].duration.count() / 1000.0);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "target");
+    lua_pushnumber(L, pRequest->stages[i].target);
+    lua_settable(L, -3);
+
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "script");
+  lua_pushlstring(L, path.data(), path.size());
+  lua_settable(L, -3);
+
+  lua_pushstring(L, "data");
+  if (pRequest->data.empty())
+    lua_pushstring(L, "");
+  else
+    lua_pushlstring(L, pRequest->data.data(), pRequest->data.size());
+  lua_settable(L, -3);
+
+  // multipart = { {name:"" , isFilePath: false, values: {""} }, .. }
+  // 如果没有数据则设置为空table，避免nil
+  lua_pushstring(L, "multipart");
+  lua_newtable(L);
+  for (size_t i = 0; i < pRequest->multipart.size(); i++) {
+    auto& it = pRequest->multipart[i];
+    // key
+    lua_pushinteger(L, i);
+
+    // value
+    lua_newtable(L);
+    lua_pushstring(L, "name");
+    lua_pushlstring(L, it.name.data(), it.name.size());
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "isFilePath");
+    lua_pushboolean(L, it.isFilePath);
+    lua_settable(L, -3);
+
+    lua_pushstring(L, "values");
+    lua_newtable(L);
+    for (int j = 0; j < it.values.size(); j++) {
+      lua_pushinteger(L, j);
+      lua_pushlstring(L, it.values[j].data(), it.values[j].size());
+      lua_settable(L, -3);
+    }
+    lua_settable(L, -3);
+
+    // to multipart
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  // headers = { key:value, ... }
+  // 如果没有数据则设置为空table，避免nil
+  lua_pushstring(L, "headers");
+  lua_newtable(L);
+  for (auto&& [k, v] : pRequest->headers) {
+    lua_pushlstring(L, k.data(), k.size());
+    lua_pushlstring(L, v.data(), v.size());
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  // responseHeaders = { "content-type", ... }
+  lua_pushstring(L, "responseHeaders");
+  lua_newtable(L);
+  for (size_t i = 0; i < pRequest->responseHeaders.size(); i++) {
+    auto& name = pRequest->responseHeaders[i].second;
+    lua_pushinteger(L, i);
+    lua_pushlstring(L, name.data(), name.size());
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+
+  lua_setglobal(L, "request");
+}
+
+void LuaScript::PresetDoScript(Request* request) {
+  auto chunkname = !code.empty() ? string("=-sc") : "@" + string(path);
+  if (luaL_loadbufferx(L, bytecode->data(), bytecode->size(),
+                       chunkname.c_str(), "b") != LUA_OK ||
+      lua_pcall(L, 0, 0, 0) != LUA_OK) {
+    cerr << "load lua " << (!code.empty() ? "code" : "file")
+         << " error: " << lua_tostring(L, -1) << endl;
+    exit(1);
+  }
+}
+
+void LuaScript::PresetResponse(Request* pRequest) {
+  if (!HasResponseFunc()) return;
+  pRequest->needflag |= (uint8_t)NEED_FLAGS::Header;
+  pRequest->needflag |= (uint8_t)NEED_FLAGS::Body;
+}
+
+void LuaScript::PresetPreset(Request* pRequest) {
+  // 调用lua预设函数
+  lua_getglobal(L, "Preset");
+  if (!lua_isfunction(L, -1)) return;
+
+  lua_call(L, 0, 0);
+
+  // 读取requst变化
+  lua_getglobal(L, "request");
+
+  // get request.method
+  lua_pushstring(L, "method");
+  lua_gettable(L, -2);
+  pRequest->methodStr = lua_tostring(L, -1);
+  lua_pop(L, 1);
+
+  // get request.url
+  lua_pushstring(L, "url");
+  lua_gettable(L, -2);
+  pRequest->url = lua_tostring(L, -1);
+  lua_pop(L, 1);
+
+  // get request.requestCount
+  lua_pushstring(L, "requestCount");
+  lua_gettable(L, -2);
+  auto requestCount = (uint32_t)lua_tointeger(L, -1);
+  if (requestCount != pRequest->requestCount) pRequest->hasRequestCount = true;
+  pRequest->requestCount = requestCount;
+  lua_pop(L, 1);
+
+  // get request.duration，数字为秒，字符串可以带单位 "10m"
+  lua_pushstring(L, "duration");
+  lua_gettable(L, -2);
+  if (lua_type(L, -1) == LUA_TNUMBER)
+    pRequest->duration =
+        chrono::milliseconds((int64_t)(lua_tonumber(L, -1) * 1000));
+  else if (lua_type(L, -1) == LUA_TSTRING)
+    pRequest->duration = utils::parseDuration(lua_tostring(L, -1));
+  lua_pop(L, 1);
+
+  // get request.stages
+  lua_pushstring(L, "stages");
+  lua_gettable(L, -2);
+  if (lua_istable(L, -1)) {
+    pRequest->stages.clear();
+
+    // 0 开始的数组，按下标顺序读取
+    lua_Integer first = lua_geti(L, -1, 0) == LUA_TNIL ? 1 : 0;
+    lua_pop(L, 1);
+    for (lua_Integer i = first;; i++) {
+      if (lua_geti(L, -1, i) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        break;
+      }
+
+      Stage stage;
+      lua_pushstring(L, "duration");
+      lua_gettable(L, -2);
+      if (lua_type(L, -1) == LUA_TNUMBER)
+        stage.duration =
+            chrono::milliseconds((int64_t)(lua_tonumber(L, -1) * 1000));
+      else
+        stage.duration = utils::parseDuration(luaL_optstring(L, -1, "0"));
+      lua_pop(L, 1);
+
+      lua_pushstring(L, "target");
+      lua_gettable(L, -2);
+      stage.target = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+
+      pRequest->stages.push_back(stage);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+
+  // get request.data
+  lua_pushstring(L, "data");
+  lua_gettable(L, -2);
+  pRequest->data = lua_tostring(L, -1);
+  lua_pop(L, 1);
+
+  // get request.headers
+  lua_pushstring(L, "headers");
+  lua_gettable(L, -2);
+  // 遍历header k/v table
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    /* uses 'key' (at index -2) and 'value' (at index -1) */
+    // printf("%s - %s\n", lua_typename(L, lua_type(L, -2)), lua_typename(L,
+    // lua_type(L, -1)));
+    auto k = lua_tostring(L, -2);
+    auto v = lua_tostring(L, -1);
+
+    // 如果key存在则替换value
+    if (pRequest->headers.find(k) != pRequest->headers.end()) {
+      pRequest->headers[k] = v;
+    } else {
+      pRequest->headers.insert({k, v});
+    }
+
+    /* removes 'value'; keeps 'key' for next iteration */
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  // get request.responseHeaders
+  lua_pushstring(L, "responseHeaders");
+  lua_gettable(L, -2);
+  if (lua_istable(L, -1)) {
+    pRequest->responseHeaders.clear();
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      pRequest->AddResponseHeader(lua_tostring(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+
+  // get request.multipart
+  lua_pushstring(L, "multipart");
+  lua_gettable(L, -2);
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    FilePart p;
+    /* uses 'key' (at index -2) and 'value' (at index -1) */
+    // auto i = lua_tointeger(L, -2);
+    // cout << "index: " << i << endl;
+
+    // get item value
+    lua_pushstring(L, "name");
+    lua_gettable(L, -2);
+    p.name = lua_tostring(L, -1);
+    lua_pop(L, 1);  // pop name
+
+    lua_pushstring(L, "isFilePath");
+    lua_gettable(L, -2);
+    p.isFilePath = lua_toboolean(L, -1);
+    lua_pop(L, 1);  // pop isFilePath
+
+    lua_pushstring(L, "values");
+    lua_gettable(L, -2);
+    // each values
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      auto it = lua_tostring(L, -1);
+      // cout << "values it: " << it << endl;
+      p.values.push_back(it);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);  // pop values
+
+    pRequest->multipart.push_back(p);
+    /* removes 'value'; keeps 'key' for next iteration */
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+void LuaScript::Preset(Request* pRequest) {
+  PresetRequestVariable(pRequest);
+  PresetDoScript(pRequest);
+  PresetResponse(pRequest);
+  PresetPreset(pRequest);
+}
+
+LuaScript* LuaScript::Copy() { return new LuaScript(this); }
+
+void LuaScript::SetGc(Request* pRequest) {
+  if (pRequest->luaGc == "gen")
+    lua_gc(L, LUA_GCGEN, 0, 0);
+  else if (pRequest->luaGc == "inc")
+    lua_gc(L, LUA_GCINC, 0, 0, 0);
+
+  // 手动 GC 时关掉自动 GC，只在请求之间回收
+  if (pRequest->luaGcStep) lua_gc(L, LUA_GCSTOP);
+}
+
+// 优先使用 RequestBatch，每 batchSize 个请求调用一次
+void LuaScript::PrepareRequest(uint32_t threadId, uint32_t batchSize) {
+  isBatch = hasGlobalFunc(L, "RequestBatch");
+  lua_getglobal(L, isBatch ? "RequestBatch" : "Request");
+  requestFuncRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  this->batchSize = isBatch ? max(batchSize, 1u) : 1;
+
+  // ctx = { thread, seq }，每次调用前更新 seq
+  lua_createtable(L, 0, 2);
+  lua_pushinteger(L, threadId);
+  lua_setfield(L, -2, "thread");
+  ctxRef = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// 表的字段直接指向 lua 字符串，表被 ref 住时不会回收
+static void readRequestSpec(lua_State* L, RequestSpec* pSpec) {
+  pSpec->method = pSpec->url = pSpec->body = string_view();
+  pSpec->hasBody = false;
+  pSpec->headers.clear();
+
+  size_t len;
+  const char* str;
+
+  // 只返回字符串时当作 url
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    str = lua_tolstring(L, -1, &len);
+    pSpec->url = string_view(str, len);
+    return;
+  }
+  if (!lua_istable(L, -1)) {
+    cerr << "Error: lua Request must return a table or url string" << endl;
+    exit(1);
+  }
+
+  if (lua_getfield(L, -1, "method") == LUA_TSTRING) {
+    str = lua_tolstring(L, -1, &len);
+    pSpec->method = string_view(str, len);
+  }
+  lua_pop(L, 1);
+
+  if (lua_getfield(L, -1, "url") == LUA_TSTRING) {
+    str = lua_tolstring(L, -1, &len);
+    pSpec->url = string_view(str, len);
+  }
+  lua_pop(L, 1);
+
+  if (lua_getfield(L, -1, "body") == LUA_TSTRING) {
+    str = lua_tolstring(L, -1, &len);
+    pSpec->body = string_view(str, len);
+    pSpec->hasBody = true;
+  }
+  lua_pop(L, 1);
+
+  if (lua_getfield(L, -1, "headers") == LUA_TTABLE) {
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING) {
+        size_t klen, vlen;
+        auto k = lua_tolstring(L, -2, &klen);
+        auto v = lua_tolstring(L, -1, &vlen);
+        pSpec->headers.push_back({string_view(k, klen), string_view(v, vlen)});
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+}
+
+/**
+ * 生成下一个请求，释放 pSpec 上一次 ref 住的表
+ * RequestBatch 返回的数组可以从 0 或 1 开始
+ */
+void LuaScript::NextRequest(RequestSpec* pSpec) {
+  luaL_unref(L, LUA_REGISTRYINDEX, pSpec->ref);
+  pSpec->ref = LUA_NOREF;
+
+  auto top = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ctxRef);
+  lua_pushinteger(L, (lua_Integer)requestSeq);
+  lua_setfield(L, -2, "seq");
+
+  if (!isBatch) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, requestFuncRef);
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 1);
+  } else {
+    if (batchRef == LUA_NOREF ||
+        lua_rawgeti(L, LUA_REGISTRYINDEX, batchRef) == LUA_TNIL ||
+        lua_rawgeti(L, -1, batchPos) == LUA_TNIL) {
+      lua_settop(L, top + 1);  // 只留下 ctx
+      luaL_unref(L, LUA_REGISTRYINDEX, batchRef);
+
+      lua_rawgeti(L, LUA_REGISTRYINDEX, requestFuncRef);
+      lua_pushinteger(L, batchSize);
+      lua_pushvalue(L, -3);
+      lua_call(L, 2, 1);
+      if (!lua_istable(L, -1)) {
+        cerr << "Error: lua RequestBatch must return an array" << endl;
+        exit(1);
+      }
+      batchPos = lua_rawgeti(L, -1, 0) == LUA_TNIL ? 1 : 0;
+      lua_pop(L, 1);
+
+      lua_pushvalue(L, -1);
+      batchRef = luaL_ref(L, LUA_REGISTRYINDEX);
+      if (lua_rawgeti(L, -1, batchPos) == LUA_TNIL) {
+        cerr << "Error: lua RequestBatch returned no request" << endl;
+        exit(1);
+      }
+    }
+    batchPos++;
+  }
+
+  readRequestSpec(L, pSpec);
+  pSpec->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_settop(L, top);
+  requestSeq++;
+}
+
+void LuaScript::GcStep(size_t kb) {
+  auto start = chrono::steady_clock::now();
+  lua_gc(L, LUA_GCSTEP, (int)kb);
+  gcTime += chrono::steady_clock::now() - start;
+}
+
+HttpClint::HttpClint(Request* pRequest) : pRequest{pRequest} {
+  hCurl = curl_easy_init();
+  pResponse = new Response(pRequest->needflag, pRequest->maxBody,
+                           pRequest->bodyTrim);
+  pResponse->pCaptureHeaders = &pRequest->responseHeaders;
+
+  SetUrl();
+  SetMethod();
+  SetHeader();
+  SetBody();
+
+  // 不需要 header 和 body，不设置 header 回调，body 直接丢掉
+  if (!pRequest->needflag) {
+    curl_easy_setopt(hCurl, CURLOPT_WRITEFUNCTION, curlDiscardCallback);
+    return;
+  }
+
+  // 返回的body
+  curl_easy_setopt(hCurl, CURLOPT_WRITEFUNCTION, curlRespBodyCallback);
+  curl_easy_setopt(hCurl, CURLOPT_WRITEDATA, pResponse);
+
+  // 返回的headers
+  curl_easy_setopt(hCurl, CURLOPT_HEADERFUNCTION, curlRespHeaderCallback);
+  curl_easy_setopt(hCurl, CURLOPT_HEADERDATA, pResponse);
+}
+
+HttpClint::~HttpClint() {
+  if (pResponse != nullptr) delete pResponse;
+
+  if (pHeaerSlist != nullptr) curl_slist_free_all(pHeaerSlist);
+
+  if (pSpecHeaders != nullptr) curl_slist_free_all(pSpecHeaders);
+
+  if (pMultipart != nullptr) curl_mime_free(pMultipart);
+
+  if (hCurl != nullptr) curl_easy_cleanup(hCurl);
+}
+
+inline void HttpClint::SetUrl() {
+  // lua 生成请求时每个请求再设置 url
+  if (pRequest->url.empty() && pRequest->dynamic) return;
+  if (pRequest->url.empty()) {
+    cerr << "Error: request url empty" << endl;
+    exit(1);
+  }
+  curl_easy_setopt(hCurl, CURLOPT_URL, pRequest->url.data());
+  curl_easy_setopt(hCurl, CURLOPT_SSL_VERIFYPEER, 0L);
+  curl_easy_setopt(hCurl, CURLOPT_SSL_VERIFYHOST, 0L);
+  curl_easy_setopt(hCurl, CURLOPT_SSL_VERIFYSTATUS, 0L);
+  // curl_easy_setopt(hCurl, CURLOPT_DOH_SSL_VERIFYPEER, 0L);
+  // curl_easy_setopt(hCurl, CURLOPT_DOH_SSL_VERIFYHOST, 0L);
+  // curl_easy_setopt(hCurl, CURLOPT_DOH_SSL_VERIFYSTATUS, 0L);
+}
+
+inline void HttpClint::SetMethod() { SetMethod(pRequest->methodStr); }
+
+void HttpClint::SetMethod(string_view name) {
+  auto m = parseMethod(name);
+  if (m != METHOD::Custom) return SetMethod(m);
+
+  // 只替换请求行里的方法名，有没有 body 由 POSTFIELDS/MIMEPOST 决定
+  customMethod.assign(name);
+  curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, customMethod.c_str());
+}
+
+void HttpClint::SetMethod(METHOD m) {
+  CURLcode code = CURLE_OK;
+
+  switch (m) {
+    case METHOD::Head:
+      code = curl_easy_setopt(hCurl, CURLOPT_NOBODY, 1L);
+      break;
+
+    case METHOD::Get:
+      code = curl_easy_setopt(hCurl, CURLOPT_HTTPGET, 1L);
+      break;
+
+    case METHOD::Post:
+      code = curl_easy_setopt(hCurl, CURLOPT_POST, 1L);
+      break;
+
+    case METHOD::Delete:
+      code = curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, "DELETE");
+      break;
+
+    case METHOD::Put:
+      code = curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, "PUT");
+      break;
+
+    case METHOD::Patch:
+      code = curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, "PATCH");
+      break;
+
+    default:
+      cerr << "Error: set method not match " << (int)m << endl;
+      exit(1);
+      break;
+  }
+
+  if (code != CURLE_OK) {
+    cerr << "Error: set mathod " << (int)m << " code " << code << endl;
+    exit(1);
+  }
+}
+
+void HttpClint::SetHeader() {
+  if (pRequest->headers.empty()) return;
+
+  for (auto&& [k, v] : pRequest->headers)
+    pHeaerSlist =
+        curl_slist_append(pHeaerSlist, (string(k) + ":" + string(v)).c_str());
+
+  curl_easy_setopt(hCurl, CURLOPT_HTTPHEADER, pHeaerSlist);
+}
+
+void HttpClint::SetBody() {
+  if (!pRequest->multipart.empty()) {
+    pMultipart = curl_mime_init(hCurl);
+
+    curl_mimepart* part = nullptr;
+
+    for (auto&& i : pRequest->multipart) {
+      auto name = i.name;
+      for (auto&& value : i.values) {
+        if (i.isFilePath) {
+          filesystem::path p{value};
+
+          part = curl_mime_addpart(pMultipart);
+          curl_mime_name(part, name.data());
+          curl_mime_filedata(part, p.filename().string().c_str());
+
+          // 所有连接读同一份映射，每个 part 自己记录读到哪里
+          auto& cursor = uploadCursors.emplace_back();
+          cursor.pFile = &pRequest->uploads.at(value);
+          curl_mime_data_cb(part, (curl_off_t)cursor.pFile->Size(),
+                            curlUploadReadCallback, curlUploadSeekCallback,
+                            NULL, &cursor);
+        } else {
+          part = curl_mime_addpart(pMultipart);
+          curl_mime_name(part, name.data());
+          // CURL_ZERO_TERMINATED 特殊size_t值，表示以空结尾的字符串
+          curl_mime_data(part, value.data(), CURL_ZERO_TERMINATED);
+        }
+      }
+    }
+
+    curl_easy_setopt(hCurl, CURLOPT_MIMEPOST, pMultipart);
+  }
+
+  if (!pRequest->data.empty()) {
+    curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, pRequest->data.size());
+    curl_easy_setopt(hCurl, CURLOPT_POSTFIELDS, pRequest->data.data());
+  } else {
+    curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, 0);
+  }
 }
 
-LuaScript::~LuaScript() { lua_close(L); }
+/**
+ * 展开 -u -d -h 里的模板，一个连接复用自己的缓冲区
+ * apply 为 false 时只展开，由后面的 ApplySpec 设置
+ */
+void HttpClint::ApplyTemplates(TemplateState* pState, bool apply) {
+  auto& t = pRequest->templates;
 
-bool LuaScript::HasResponseFunc() {
-  lua_getglobal(L, "Response");
-  return lua_isfunction(L, -1) == 1;
-}
+  if (t.hasUrlSlots) {
+    urlBuf.clear();
+    t.url.Expand(pState, &urlBuf);
+    if (apply) curl_easy_setopt(hCurl, CURLOPT_URL, urlBuf.c_str());
+  }
 
-bool LuaScript::HasRunDoneFunc() {
-  lua_getglobal(L, "RunDone");
-  return lua_isfunction(L, -1) == 1;
+  if (t.hasDataSlots) {
+    bodyBuf.clear();
+    t.data.Expand(pState, &bodyBuf);
+    if (apply && pMultipart == nullptr) {
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, (long)bodyBuf.size());
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDS, bodyBuf.data());
+    }
+  }
+
+  // curl 只读 slist，节点直接指向自己的缓冲区，不用每次分配
+  if (t.hasHeaderSlots) {
+    auto n = t.headers.size();
+    headerLines.resize(n);
+    headerNodes.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      auto& line = headerLines[i];
+      line.assign(t.headers[i].first).append(":");
+      t.headers[i].second.Expand(pState, &line);
+    }
+    for (size_t i = 0; i < n; i++) {
+      headerNodes[i].data = headerLines[i].data();
+      headerNodes[i].next = i + 1 < n ? &headerNodes[i + 1] : nullptr;
+    }
+    if (apply) curl_easy_setopt(hCurl, CURLOPT_HTTPHEADER, headerNodes.data());
+  }
+
+  pState->seq += pState->step;
 }
 
-int lua_bodyText(lua_State* L) {
-  // 闭包参数1
-  // auto p1 = lua_tostring(L, lua_upvalueindex(1));
-  // cout << "闭包参数1: " << p1 << endl;
+/**
+ * 按 lua、--corpus、--replay 生成的 spec 重新设置这个 easy handle
+ * url 由 curl 复制；header 链表 curl 不复制，pSpecHeaders 保留到下一个请求
+ * body 不复制，直接使用 lua 字符串或者文件映射，发送完之前一直有效
+ */
+void HttpClint::ApplySpec() {
+  auto& t = pRequest->templates;
+  auto url = !spec.url.empty() ? spec.url
+             : t.hasUrlSlots   ? string_view(urlBuf)
+                               : pRequest->url;
+  if (url.empty()) {
+    cerr << "Error: request url empty" << endl;
+    exit(1);
+  }
+  curl_easy_setopt(hCurl, CURLOPT_URL, url.data());
 
-  auto p1 = (uintptr_t*)lua_touserdata(L, lua_upvalueindex(1));
-  auto pResponse = (Response*)*p1;
+  // lua 的 header 覆盖同名的 -h
+  if (pSpecHeaders != nullptr) {
+    curl_slist_free_all(pSpecHeaders);
+    pSpecHeaders = nullptr;
+  }
+  if (!spec.headers.empty()) {
+    auto overridden = [this](string_view name) {
+      for (auto&& it : spec.headers)
+        if (utils::equalsIgnoreCase(it.first, name)) return true;
+      return false;
+    };
+
+    string line;
+    if (t.hasHeaderSlots) {
+      for (size_t i = 0; i < t.headers.size(); i++)
+        if (!overridden(t.headers[i].first))
+          pSpecHeaders =
+              curl_slist_append(pSpecHeaders, headerLines[i].c_str());
+    } else {
+      for (auto&& [k, v] : pRequest->headers) {
+        if (overridden(k)) continue;
+        line.assign(k).append(":").append(v);
+        pSpecHeaders = curl_slist_append(pSpecHeaders, line.c_str());
+      }
+    }
+    for (auto&& [k, v] : spec.headers) {
+      line.assign(k).append(":").append(v);
+      pSpecHeaders = curl_slist_append(pSpecHeaders, line.c_str());
+    }
+  }
+  curl_easy_setopt(hCurl, CURLOPT_HTTPHEADER,
+                   pSpecHeaders != nullptr ? pSpecHeaders
+                   : t.hasHeaderSlots      ? headerNodes.data()
+                                           : pHeaerSlist);
+
+  // 先清掉上一个请求的 body，不再指向已经释放的 lua 字符串
+  curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, 0L);
+  curl_easy_setopt(hCurl, CURLOPT_POSTFIELDS, "");
+  curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, NULL);
+  curl_easy_setopt(hCurl, CURLOPT_NOBODY, 0L);
+  curl_easy_setopt(hCurl, CURLOPT_HTTPGET, 1L);
+
+  auto setBody = [this] {
+    if (spec.hasBody) {
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, (long)spec.body.size());
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDS, spec.body.data());
+    } else if (pMultipart != nullptr) {
+      curl_easy_setopt(hCurl, CURLOPT_MIMEPOST, pMultipart);
+    } else if (pRequest->templates.hasDataSlots) {
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, (long)bodyBuf.size());
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDS, bodyBuf.data());
+    } else if (!pRequest->data.empty()) {
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE,
+                       (long)pRequest->data.size());
+      curl_easy_setopt(hCurl, CURLOPT_POSTFIELDS, pRequest->data.data());
+    }
+  };
 
-  // 设置 lua 函数返回值
-  lua_pushlstring(L, (char*)pResponse->body.data, pResponse->body.size);
-  return 1;
+  // 设置 body 会把 method 改成 POST
+  // lua 指定了 method 时以它为准，否则和 -m/-d 一样 body 在后
+  if (!spec.method.empty()) {
+    setBody();
+    SetMethod(spec.method);
+  } else {
+    SetMethod(pRequest->methodStr);
+    setBody();
+  }
 }
 
-int lua_bodyJson(lua_State* L) {
-  auto p1 = (uintptr_t*)lua_touserdata(L, lua_upvalueindex(1));
-  auto pResponse = (Response*)*p1;
-
-  json data = json::parse(
-      string_view((char*)pResponse->body.data, pResponse->body.size));
+CURLcode HttpClint::Send() { return curl_easy_perform(hCurl); }
 
-  // 设置 lua 函数返回值
-  utils::lua_pushjson(L, data);
-  return 1;
+// 清理上一次请求的返回结果
+inline void HttpClint::Clear() {
+  pResponse->Clear();
+  for (auto&& it : uploadCursors) it.offset = 0;
+  sendTime = chrono::steady_clock::now();
 }
 
-bool LuaScript::CallResponse(Response* pResponse) {
-  if (!HasResponseFunc()) {
-    cerr << "Error: "
-         << "script not Response function" << endl;
-    exit(1);
+inline Response* HttpClint::GetResponsePtr() {
+  curl_easy_getinfo(hCurl, CURLINFO_RESPONSE_CODE, &pResponse->statusCode);
+
+  curl_off_t bodySize{0};
+  curl_easy_getinfo(hCurl, CURLINFO_SIZE_DOWNLOAD_T, &bodySize);
+  pResponse->bodySize = (size_t)bodySize;
+
+  // 没有回调累计大小
+  if (!pRequest->needflag) {
+    long headerSize{0};
+    curl_easy_getinfo(hCurl, CURLINFO_HEADER_SIZE, &headerSize);
+    pResponse->size = (size_t)bodySize + headerSize;
   }
 
-  // 获取 Response 函数
-  lua_getglobal(L, "Response");
+  return pResponse;
+}
 
-  // 设置函数参数 response
-  lua_newtable(L);
+inline CURL* HttpClint::GetHandle() { return hCurl; }
 
-  // response.statusCode
-  lua_pushstring(L, "statusCode");
-  lua_pushinteger(L, pResponse->statusCode);
-  lua_settable(L, -3);  // set statusCode to response
+// 开环模式从计划发送时间开始计算延迟
+inline void HttpClint::SetSendTime(chrono::steady_clock::time_point time) {
+  sendTime = time;
+}
 
-  // response.headers
-  auto _headers = pResponse->GetHeaders();
+// 从 Clear 或 SetSendTime 到现在的时间
+inline uint64_t HttpClint::LatencyUs() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now() - sendTime)
+      .count();
+}
 
-  lua_pushstring(L, "headers");
-  lua_newtable(L);
-  for (auto&& [k, v] : _headers) {
-    lua_pushlstring(L, k.data(), k.size());
-    lua_pushlstring(L, v.data(), v.size());
-    lua_settable(L, -3);  // set k/v to headers
+inline void HttpClint::GetPhaseTimes(PhaseTimes* pTimes) {
+  curl_easy_getinfo(hCurl, CURLINFO_NAMELOOKUP_TIME_T, &pTimes->namelookup);
+  curl_easy_getinfo(hCurl, CURLINFO_CONNECT_TIME_T, &pTimes->connect);
+  curl_easy_getinfo(hCurl, CURLINFO_APPCONNECT_TIME_T, &pTimes->appconnect);
+  curl_easy_getinfo(hCurl, CURLINFO_PRETRANSFER_TIME_T, &pTimes->pretransfer);
+  curl_easy_getinfo(hCurl, CURLINFO_STARTTRANSFER_TIME_T,
+                    &pTimes->starttransfer);
+  curl_easy_getinfo(hCurl, CURLINFO_TOTAL_TIME_T, &pTimes->total);
+  curl_easy_getinfo(hCurl, CURLINFO_NUM_CONNECTS, &pTimes->numConnects);
+}
+
+Histogram::Histogram(uint64_t highest, int32_t sigDigits)
+    : highest{highest}, sigDigits{sigDigits} {
+  // 2 * 10^sigDigits 以内的值精确到 1
+  uint64_t largestSingleUnit = 2;
+  for (int32_t i = 0; i < sigDigits; i++) largestSingleUnit *= 10;
+
+  int32_t subBucketCountMagnitude = (int32_t)ceil(log2(largestSingleUnit));
+  subBucketHalfCountMagnitude = max(subBucketCountMagnitude, 1) - 1;
+  subBucketCount = 1 << (subBucketHalfCountMagnitude + 1);
+  subBucketHalfCount = subBucketCount / 2;
+  subBucketMask = (uint64_t)subBucketCount - 1;
+
+  uint64_t smallestUntrackable = (uint64_t)subBucketCount;
+  bucketCount = 1;
+  while (smallestUntrackable <= highest) {
+    if (smallestUntrackable > UINT64_MAX / 2) {
+      bucketCount++;
+      break;
+    }
+    smallestUntrackable <<= 1;
+    bucketCount++;
   }
-  lua_settable(L, -3);  // set headers to response
 
-  // response.body
-  lua_pushstring(L, "body");
-  lua_newtable(L);  // new body teble
+  counts.assign((size_t)(bucketCount + 1) * subBucketHalfCount, 0);
+}
 
-  // response.body.size
-  lua_pushstring(L, "size");
-  lua_pushinteger(L, pResponse->body.size);
-  lua_settable(L, -3);  // set size to body
-
-  // response.body.text()
-  lua_pushstring(L, "text");
-  // 设置闭包参数为 pResponse
-  // lua_pushstring(L, "闭包参数1");
-  auto bp = (uintptr_t*)lua_newuserdatauv(L, sizeof(uintptr_t), 1);
-  *bp = (uintptr_t)pResponse;
-  lua_pushcclosure(L, lua_bodyText, 1);
-  lua_settable(L, -3);  // set text() to body
-
-  // response.body.json()
-  lua_pushstring(L, "json");
-  auto bp2 = (uintptr_t*)lua_newuserdatauv(L, sizeof(uintptr_t), 1);
-  *bp2 = (uintptr_t)pResponse;
-  lua_pushcclosure(L, lua_bodyJson, 1);
-  lua_settable(L, -3);  // set json() to body
-
-  lua_settable(L, -3);  // set body to response
-
-  // response.size
-  lua_pushstring(L, "size");
-  lua_pushinteger(L, pResponse->size);
-  lua_settable(L, -3);  // set size to response
+inline size_t Histogram::CountsIndex(uint64_t value) {
+  int32_t pow2ceiling = 64 - countl_zero(value | subBucketMask);
+  int32_t bucketIndex = pow2ceiling - (subBucketHalfCountMagnitude + 1);
+  int32_t subBucketIndex = (int32_t)(value >> bucketIndex);
+  return ((size_t)(bucketIndex + 1) << subBucketHalfCountMagnitude) +
+         (subBucketIndex - subBucketHalfCount);
+}
 
-  // 调用函数，1个参数，1个返回值
-  lua_call(L, 1, 1);  // call lua Response function
+uint64_t Histogram::ValueFromIndex(size_t index) {
+  int32_t bucketIndex = (int32_t)(index >> subBucketHalfCountMagnitude) - 1;
+  int32_t subBucketIndex =
+      (int32_t)(index & (subBucketHalfCount - 1)) + subBucketHalfCount;
+  if (bucketIndex < 0) {
+    subBucketIndex -= subBucketHalfCount;
+    bucketIndex = 0;
+  }
+  return (uint64_t)subBucketIndex << bucketIndex;
+}
 
-  // 获取返回值
-  auto ok = lua_toboolean(L, -1);  // get lua Response function return value
+// 和 value 落在同一个格子里的最大值
+uint64_t Histogram::HighestEquivalent(uint64_t value) {
+  auto lowest = ValueFromIndex(CountsIndex(value));
+  int32_t pow2ceiling = 64 - countl_zero(value | subBucketMask);
+  int32_t bucketIndex = pow2ceiling - (subBucketHalfCountMagnitude + 1);
+  return lowest + ((uint64_t)1 << bucketIndex) - 1;
+}
 
-  return ok;
+uint64_t Histogram::MedianEquivalent(uint64_t value) {
+  auto lowest = ValueFromIndex(CountsIndex(value));
+  return lowest + (HighestEquivalent(value) - lowest + 1) / 2;
 }
 
-void LuaScript::CallRunDone(RunResult* result) {
-  if (!HasRunDoneFunc()) {
-    cerr << "Error: "
-         << "script not RunDone function" << endl;
-    exit(1);
+void Histogram::Record(uint64_t value) {
+  if (value > highest) value = highest;
+
+  // 只有一个线程写，用 atomic_ref 是为了 CopyFrom 可以在其他线程同时读
+  auto& count = counts[CountsIndex(value)];
+  atomic_ref<uint64_t>(count).store(count + 1, memory_order_relaxed);
+  atomic_ref<uint64_t>(totalCount).store(totalCount + 1, memory_order_relaxed);
+  if (value < minValue)
+    atomic_ref<uint64_t>(minValue).store(value, memory_order_relaxed);
+  if (value > maxValue)
+    atomic_ref<uint64_t>(maxValue).store(value, memory_order_relaxed);
+}
+
+void Histogram::CopyFrom(Histogram& other) {
+  counts.resize(other.counts.size());
+  totalCount = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    counts[i] = atomic_ref<uint64_t>(other.counts[i]).load(memory_order_relaxed);
+    totalCount += counts[i];
   }
+  minValue = atomic_ref<uint64_t>(other.minValue).load(memory_order_relaxed);
+  maxValue = atomic_ref<uint64_t>(other.maxValue).load(memory_order_relaxed);
+}
 
-  // 获取函数
-  lua_getglobal(L, "RunDone");
+void Histogram::Diff(Histogram& now, Histogram& prev) {
+  counts.resize(now.counts.size());
+  totalCount = 0;
+  minValue = UINT64_MAX;
+  maxValue = 0;
 
-  // 设置函数参数 result
-  lua_newtable(L);
+  for (size_t i = 0; i < counts.size(); i++) {
+    counts[i] = now.counts[i] - (i < prev.counts.size() ? prev.counts[i] : 0);
+    if (!counts[i]) continue;
 
-  // 设置 result.threadCount
-  lua_pushstring(L, "threadCount");
-  lua_pushinteger(L, result->threadCount);
-  lua_settable(L, -3);
+    totalCount += counts[i];
+    auto value = ValueFromIndex(i);
+    minValue = min(minValue, value);
+    maxValue = max(maxValue, min(HighestEquivalent(value), now.maxValue));
+  }
+}
 
-  // 设置 result.respDataCount
-  lua_pushstring(L, "respDataCount");
-  lua_pushinteger(L, result->respDataCount);
-  lua_settable(L, -3);
+void Histogram::Merge(const Histogram& other) {
+  if (other.counts.size() != counts.size()) {
+    cerr << "Error: merge histogram with different layout" << endl;
+    exit(1);
+  }
 
-  // 设置 result.successCount
-  lua_pushstring(L, "successCount");
-  lua_pushinteger(L, result->successCount);
-  lua_settable(L, -3);
+  for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+  totalCount += other.totalCount;
+  minValue = min(minValue, other.minValue);
+  maxValue = max(maxValue, other.maxValue);
+}
 
-  // 设置 result.errorCount
-  lua_pushstring(L, "errorCount");
-  lua_pushinteger(L, result->errorCount);
-  lua_settable(L, -3);
+void Histogram::Reset() {
+  fill(counts.begin(), counts.end(), 0);
+  totalCount = 0;
+  minValue = UINT64_MAX;
+  maxValue = 0;
+}
 
-  // 设置 result.timeMs
-  lua_pushstring(L, "timeMs");
-  lua_pushinteger(L, result->time.count());
-  lua_settable(L, -3);
+void PhaseHistograms::Record(const PhaseTimes& times) {
+  // curl 给的都是从开始到该阶段结束的累计时间，复用连接时前几个阶段为 0
+  auto tDns = max(times.namelookup, (curl_off_t)0);
+  auto tConnect = max(times.connect, tDns);
+  auto tTls = max(times.appconnect, tConnect);
+  auto tPretransfer = max(times.pretransfer, tTls);
+  auto tStart = max(times.starttransfer, tPretransfer);
+  auto tTotal = max(times.total, tStart);
+
+  // 只有新建连接时 dns/connect/tls 才有意义
+  if (times.numConnects > 0) {
+    dns.Record(tDns);
+    connect.Record(tConnect - tDns);
+    if (times.appconnect > 0) tls.Record(tTls - tConnect);
+  }
+  pretransfer.Record(tPretransfer - tTls);
+  wait.Record(tStart - tPretransfer);
+  transfer.Record(tTotal - tStart);
+  total.Record(tTotal);
+}
 
-  // 调用函数，1个参数，0个返回值
-  lua_call(L, 1, 0);
+void PhaseHistograms::Merge(PhaseHistograms& other) {
+  auto items = Items();
+  auto otherItems = other.Items();
+  for (size_t i = 0; i < items.size(); i++)
+    items[i].second->Merge(*otherItems[i].second);
 }
 
-void LuaScript::PresetRequestVariable(Request* pRequest) {
-  // 全局变量 request table
-  lua_newtable(L);
+void PhaseHistograms::Reset() {
+  for (auto&& [name, pHistogram] : Items()) pHistogram->Reset();
+}
 
-  lua_pushstring(L, "method");
-  lua_pushlstring(L, pRequest->methodStr.data(), pRequest->methodStr.size());
-  lua_settable(L, -3);
+array<pair<const char*, Histogram*>, 7> PhaseHistograms::Items() {
+  return {{
+      {"dns", &dns},
+      {"connect", &connect},
+      {"tls", &tls},
+      {"pretransfer", &pretransfer},
+      {"wait", &wait},
+      {"transfer", &transfer},
+      {"total", &total},
+  }};
+}
 
-  lua_pushstring(L, "url");
-  lua_pushlstring(L, pRequest->url.data(), pRequest->url.size());
-  lua_settable(L, -3);
+void Histogram::WriteJson(ostream& out) {
+  out << "{\"count\":" << totalCount << ",\"min\":" << Min()
+      << ",\"max\":" << maxValue << ",\"mean\":" << json(Mean()).dump()
+      << ",\"stdev\":" << json(Stdev()).dump();
 
-  lua_pushstring(L, "requestCount");
-  lua_pushinteger(L, pRequest->requestCount);
-  lua_settable(L, -3);
+  const pair<const char*, double> percentiles[] = {
+      {"p50", 50}, {"p75", 75},    {"p90", 90},
+      {"p99", 99}, {"p999", 99.9}, {"p9999", 99.99},
+  };
+  for (auto&& [name, p] : percentiles)
+    out << ",\"" << name << "\":" << Percentile(p);
+
+  // 只输出有数据的格子，value 为格子里的最大值
+  out << ",\"buckets\":[";
+  bool first = true;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (!counts[i]) continue;
+    if (!first) out << ',';
+    first = false;
+    out << '[' << HighestEquivalent(ValueFromIndex(i)) << ',' << counts[i]
+        << ']';
+  }
+  out << "]}";
+}
 
-  lua_pushstring(L, "script");
-  lua_pushlstring(L, path.data(), path.size());
-  lua_settable(L, -3);
+double Histogram::Mean() {
+  if (!totalCount) return 0;
 
-  lua_pushstring(L, "data");
-  if (pRequest->data.empty())
-    lua_pushstring(L, "");
-  else
-    lua_pushlstring(L, pRequest->data.data(), pRequest->data.size());
-  lua_settable(L, -3);
+  double total = 0;
+  for (size_t i = 0; i < counts.size(); i++)
+    if (counts[i])
+      total += (double)MedianEquivalent(ValueFromIndex(i)) * counts[i];
+  return total / totalCount;
+}
 
-  // multipart = { {name:"" , isFilePath: false, values: {""} }, .. }
-  // 如果没有数据则设置为空table，避免nil
-  lua_pushstring(L, "multipart");
-  lua_newtable(L);
-  for (size_t i = 0; i < pRequest->multipart.size(); i++) {
-    auto& it = pRequest->multipart[i];
-    // key
-    lua_pushinteger(L, i);
+double Histogram::Stdev() {
+  if (!totalCount) return 0;
 
-    // value
-    lua_newtable(L);
-    lua_pushstring(L, "name");
-    lua_pushlstring(L, it.name.data(), it.name.size());
-    lua_settable(L, -3);
+  double mean = Mean(), total = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (!counts[i]) continue;
+    double dev = (double)MedianEquivalent(ValueFromIndex(i)) - mean;
+    total += dev * dev * counts[i];
+  }
+  return sqrt(total / totalCount);
+}
 
-    lua_pushstring(L, "isFilePath");
-    lua_pushboolean(L, it.isFilePath);
-    lua_settable(L, -3);
+uint64_t Histogram::Percentile(double percentile) {
+  if (!totalCount) return 0;
 
-    lua_pushstring(L, "values");
-    lua_newtable(L);
-    for (int j = 0; j < it.values.size(); j++) {
-      lua_pushinteger(L, j);
-      lua_pushlstring(L, it.values[j].data(), it.values[j].size());
-      lua_settable(L, -3);
-    }
-    lua_settable(L, -3);
+  percentile = min(max(percentile, 0.0), 100.0);
+  auto countAtPercentile =
+      max((uint64_t)(percentile / 100 * totalCount + 0.5), (uint64_t)1);
 
-    // to multipart
-    lua_settable(L, -3);
+  uint64_t total = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    total += counts[i];
+    if (total >= countAtPercentile)
+      return min(HighestEquivalent(ValueFromIndex(i)), maxValue);
   }
-  lua_settable(L, -3);
+  return maxValue;
+}
 
-  // headers = { key:value, ... }
-  // 如果没有数据则设置为空table，避免nil
-  lua_pushstring(L, "headers");
-  lua_newtable(L);
-  for (auto&& [k, v] : pRequest->headers) {
-    lua_pushlstring(L, k.data(), k.size());
-    lua_pushlstring(L, v.data(), v.size());
-    lua_settable(L, -3);
+void Histogram::WritePercentiles(FILE* file, double scale) {
+  fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile",
+          "TotalCount", "1/(1-Percentile)");
+
+  // 和 HdrHistogram 一样每接近 100% 一半的距离输出 5 行
+  const int32_t ticksPerHalfDistance = 5;
+  double percentileTo = 0;
+  uint64_t cumulative = 0;
+
+  for (size_t i = 0; i < counts.size() && cumulative < totalCount; i++) {
+    if (!counts[i]) continue;
+    cumulative += counts[i];
+
+    double current = 100.0 * cumulative / totalCount;
+    auto value = min(HighestEquivalent(ValueFromIndex(i)), maxValue);
+    while (percentileTo <= current && cumulative < totalCount) {
+      double p = percentileTo / 100;
+      fprintf(file, "%12.3f %2.12f %10llu %14.2f\n", value / scale, p,
+              (unsigned long long)cumulative, 1 / (1 - p));
+
+      auto halfDistance =
+          pow(2, (int64_t)(log2(100 / (100 - percentileTo))) + 1);
+      percentileTo += 100 / (ticksPerHalfDistance * halfDistance);
+    }
   }
-  lua_settable(L, -3);
 
-  lua_setglobal(L, "request");
+  if (totalCount)
+    fprintf(file, "%12.3f %2.12f %10llu\n", maxValue / scale, 1.0,
+            (unsigned long long)totalCount);
+
+  fprintf(file, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+          Mean() / scale, Stdev() / scale);
+  fprintf(file, "#[Max     = %12.3f, Total count    = %12llu]\n",
+          maxValue / scale, (unsigned long long)totalCount);
+  fprintf(file, "#[Buckets = %12d, SubBuckets     = %12d]\n", bucketCount,
+          subBucketCount);
 }
 
-void LuaScript::PresetDoScript(Request* request) {
-  if (!code.empty() && luaL_dostring(L, code.data()) != LUA_OK) {
-    cerr << "load lua code error" << endl;
-    exit(1);
-  }
+MultiLoop::MultiLoop() {
+  hMulti = curl_multi_init();
 
-  if (!path.empty() && luaL_dofile(L, path.data()) != LUA_OK) {
-    cerr << "load lua file error" << endl;
+#ifdef __linux__
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    cerr << "Error: epoll_create1" << endl;
     exit(1);
   }
-}
 
-void LuaScript::PresetResponse(Request* pRequest) {
-  if (!HasResponseFunc()) return;
-  pRequest->needflag |= (uint8_t)NEED_FLAGS::Header;
-  pRequest->needflag |= (uint8_t)NEED_FLAGS::Body;
+  curl_multi_setopt(hMulti, CURLMOPT_SOCKETFUNCTION, curlMultiSocketCallback);
+  curl_multi_setopt(hMulti, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(hMulti, CURLMOPT_TIMERFUNCTION, curlMultiTimerCallback);
+  curl_multi_setopt(hMulti, CURLMOPT_TIMERDATA, this);
+#endif
 }
 
-void LuaScript::PresetPreset(Request* pRequest) {
-  // 调用lua预设函数
-  lua_getglobal(L, "Preset");
-  if (!lua_isfunction(L, -1)) return;
+MultiLoop::~MultiLoop() {
+  if (hMulti != nullptr) curl_multi_cleanup(hMulti);
 
-  lua_call(L, 0, 0);
+#ifdef __linux__
+  if (epfd != -1) close(epfd);
+#endif
+}
 
-  // 读取requst变化
-  lua_getglobal(L, "request");
+void MultiLoop::Add(HttpClint* pClint) {
+  curl_easy_setopt(pClint->GetHandle(), CURLOPT_PRIVATE, pClint);
+  curl_multi_add_handle(hMulti, pClint->GetHandle());
+  inflight++;
+}
 
-  // get request.method
-  lua_pushstring(L, "method");
-  lua_gettable(L, -2);
-  pRequest->methodStr = lua_tostring(L, -1);
-  lua_pop(L, 1);
+void MultiLoop::Remove(HttpClint* pClint) {
+  curl_multi_remove_handle(hMulti, pClint->GetHandle());
+  inflight--;
+}
 
-  // get request.url
-  lua_pushstring(L, "url");
-  lua_gettable(L, -2);
-  pRequest->url = lua_tostring(L, -1);
-  lua_pop(L, 1);
+void MultiLoop::WatchSocket(curl_socket_t s, int what, void* socketp) {
+#ifdef __linux__
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s, nullptr);
+    curl_multi_assign(hMulti, s, nullptr);
+    return;
+  }
 
-  // get request.requestCount
-  lua_pushstring(L, "requestCount");
-  lua_gettable(L, -2);
-  pRequest->requestCount = (uint32_t)lua_tointeger(L, -1);
-  lua_pop(L, 1);
+  epoll_event ev{};
+  if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+  ev.data.fd = s;
 
-  // get request.data
-  lua_pushstring(L, "data");
-  lua_gettable(L, -2);
-  pRequest->data = lua_tostring(L, -1);
-  lua_pop(L, 1);
+  // socketp 非空表示这个 socket 已经加入过 epoll
+  if (socketp == nullptr) {
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+    curl_multi_assign(hMulti, s, this);
+  } else {
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s, &ev);
+  }
+#endif
+}
 
-  // get request.headers
-  lua_pushstring(L, "headers");
-  lua_gettable(L, -2);
-  // 遍历header k/v table
-  lua_pushnil(L);
-  while (lua_next(L, -2) != 0) {
-    /* uses 'key' (at index -2) and 'value' (at index -1) */
-    // printf("%s - %s\n", lua_typename(L, lua_type(L, -2)), lua_typename(L,
-    // lua_type(L, -1)));
-    auto k = lua_tostring(L, -2);
-    auto v = lua_tostring(L, -1);
+void MultiLoop::SetTimer(long timeoutMs) {
+  hasDeadline = timeoutMs >= 0;
+  if (hasDeadline)
+    deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+}
 
-    // 如果key存在则替换value
-    if (pRequest->headers.find(k) != pRequest->headers.end()) {
-      pRequest->headers[k] = v;
-    } else {
-      pRequest->headers.insert({k, v});
-    }
+// maxWaitMs 最多等待多久，-1 为一直等到有事件
+void MultiLoop::Wait(int maxWaitMs) {
+  int running = 0;
+
+#ifdef __linux__
+  int waitMs = maxWaitMs;
+  if (hasDeadline) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(
+        deadline - chrono::steady_clock::now());
+    int timerMs = (int)max(left.count(), (chrono::milliseconds::rep)0);
+    waitMs = waitMs < 0 ? timerMs : min(waitMs, timerMs);
+  }
 
-    /* removes 'value'; keeps 'key' for next iteration */
-    lua_pop(L, 1);
+  epoll_event events[64];
+  int n = epoll_wait(epfd, events, 64, waitMs);
+
+  for (int i = 0; i < n; i++) {
+    int mask = 0;
+    if (events[i].events & EPOLLIN) mask |= CURL_CSELECT_IN;
+    if (events[i].events & EPOLLOUT) mask |= CURL_CSELECT_OUT;
+    if (events[i].events & (EPOLLERR | EPOLLHUP)) mask |= CURL_CSELECT_ERR;
+    curl_multi_socket_action(hMulti, events[i].data.fd, mask, &running);
   }
-  lua_pop(L, 1);
 
-  // get request.multipart
-  lua_pushstring(L, "multipart");
-  lua_gettable(L, -2);
-  lua_pushnil(L);
-  while (lua_next(L, -2) != 0) {
-    FilePart p;
-    /* uses 'key' (at index -2) and 'value' (at index -1) */
-    // auto i = lua_tointeger(L, -2);
-    // cout << "index: " << i << endl;
+  if (hasDeadline && chrono::steady_clock::now() >= deadline) {
+    hasDeadline = false;
+    curl_multi_socket_action(hMulti, CURL_SOCKET_TIMEOUT, 0, &running);
+  }
+#else
+  curl_multi_perform(hMulti, &running);
+  curl_multi_poll(hMulti, nullptr, 0,
+                  maxWaitMs < 0 ? 1000 : min(maxWaitMs, 1000), nullptr);
+  curl_multi_perform(hMulti, &running);
+#endif
+}
 
-    // get item value
-    lua_pushstring(L, "name");
-    lua_gettable(L, -2);
-    p.name = lua_tostring(L, -1);
-    lua_pop(L, 1);  // pop name
+// 取出一个已完成的请求，没有则返回 nullptr
+HttpClint* MultiLoop::Done(CURLcode* pCode) {
+  int msgs = 0;
+  CURLMsg* msg;
+  while ((msg = curl_multi_info_read(hMulti, &msgs)) != nullptr) {
+    if (msg->msg != CURLMSG_DONE) continue;
+
+    HttpClint* pClint{nullptr};
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &pClint);
+    *pCode = msg->data.result;
+    Remove(pClint);
+    return pClint;
+  }
+  return nullptr;
+}
 
-    lua_pushstring(L, "isFilePath");
-    lua_gettable(L, -2);
-    p.isFilePath = lua_toboolean(L, -1);
-    lua_pop(L, 1);  // pop isFilePath
+static inline uint64_t packRange(uint32_t next, uint32_t end) {
+  return ((uint64_t)end << 32) | next;
+}
 
-    lua_pushstring(L, "values");
-    lua_gettable(L, -2);
-    // each values
-    lua_pushnil(L);
-    while (lua_next(L, -2) != 0) {
-      auto it = lua_tostring(L, -1);
-      // cout << "values it: " << it << endl;
-      p.values.push_back(it);
-      lua_pop(L, 1);
-    }
-    lua_pop(L, 1);  // pop values
+TicketPool::TicketPool(uint32_t total, uint32_t workers)
+    : total{total}, slots(max(workers, (uint32_t)1)) {
+  // 每个线程大约领 8 批，剩余不多时靠 Steal 均衡
+  batch = clamp(total / ((uint32_t)slots.size() * 8), (uint32_t)1,
+                (uint32_t)1024);
+}
 
-    pRequest->multipart.push_back(p);
-    /* removes 'value'; keeps 'key' for next iteration */
-    lua_pop(L, 1);
+bool TicketPool::TakeFrom(Slot& slot) {
+  auto r = slot.range.load(memory_order_relaxed);
+  for (;;) {
+    uint32_t next = (uint32_t)r, end = (uint32_t)(r >> 32);
+    if (next >= end) return false;
+    if (slot.range.compare_exchange_weak(r, packRange(next + 1, end),
+                                         memory_order_relaxed))
+      return true;
   }
-  lua_pop(L, 1);
 }
 
-void LuaScript::Preset(Request* pRequest) {
-  PresetRequestVariable(pRequest);
-  PresetDoScript(pRequest);
-  PresetResponse(pRequest);
-  PresetPreset(pRequest);
+bool TicketPool::Steal(uint32_t worker) {
+  for (size_t i = 1; i < slots.size(); i++) {
+    auto& victim = slots[(worker + i) % slots.size()];
+    auto r = victim.range.load(memory_order_relaxed);
+    for (;;) {
+      uint32_t next = (uint32_t)r, end = (uint32_t)(r >> 32);
+      if (next >= end) break;
+
+      // 偷走后一半
+      uint32_t mid = next + (end - next) / 2;
+      if (victim.range.compare_exchange_weak(r, packRange(next, mid),
+                                             memory_order_relaxed)) {
+        slots[worker].range.store(packRange(mid + 1, end),
+                                  memory_order_relaxed);
+        return true;
+      }
+    }
+  }
+  return false;
 }
 
-LuaScript* LuaScript::Copy() {
-  auto c = new LuaScript(path, code);
-  return c;
+bool TicketPool::Take(uint32_t worker) {
+  auto& slot = slots[worker];
+  if (TakeFrom(slot)) return true;
+
+  if (claimed.load(memory_order_relaxed) < total) {
+    auto start = claimed.fetch_add(batch, memory_order_relaxed);
+    if (start < total) {
+      auto end = (uint32_t)min(start + batch, (uint64_t)total);
+      slot.range.store(packRange((uint32_t)start + 1, end),
+                       memory_order_relaxed);
+      return true;
+    }
+  }
+
+  return Steal(worker);
 }
 
-HttpClint::HttpClint(Request* pRequest) : pRequest{pRequest} {
-  hCurl = curl_easy_init();
-  pResponse = new Response(pRequest->needflag);
+// 压测开始前在工作线程里准备 lua_State，时间单独统计
+static void setupWorker(Worker* pWorker) {
+  auto start = chrono::steady_clock::now();
+
+  // 每个线程自己的序号和随机数，不共享状态
+  pWorker->templateState.seq = pWorker->id;
+  pWorker->templateState.step = pWorker->threadCount;
+  pWorker->templateState.rng =
+      (uint64_t)start.time_since_epoch().count() ^
+      ((uint64_t)(pWorker->id + 1) * 0x9e3779b97f4a7c15ull);
+
+  if (pWorker->pLuaScript != nullptr) {
+    auto pScript = pWorker->pLocalScript = pWorker->pLuaScript->Copy();
+    pScript->SetGc(pWorker->pRequest);
+    pScript->PresetRequestVariable(pWorker->pRequest);
+    pScript->PresetDoScript(pWorker->pRequest);
+
+    pWorker->luaResponse = pScript->HasResponseFunc();
+    pWorker->luaRequest = pScript->HasRequestFunc();
+    if (pWorker->luaRequest)
+      pScript->PrepareRequest(pWorker->id, pWorker->pRequest->luaBatch);
+  }
+  pWorker->setupTime = chrono::duration_cast<chrono::microseconds>(
+      chrono::steady_clock::now() - start);
+}
 
-  SetUrl();
-  SetMethod();
-  SetHeader();
-  SetBody();
+/**
+ * 先检查 --expect-* 断言，通过后有 lua Response 函数时交给脚本判断
+ * 都没有指定状态码时 2xx 为成功
+ */
+static inline bool isResponseSuccess(Response* pResp, LuaScript* copyLuaScript,
+                                     Assertions* pAssertions) {
+  if (!pAssertions->Check(pResp)) return false;
+  if (copyLuaScript != nullptr) return copyLuaScript->CallResponse(pResp);
+  return pAssertions->hasStatus ||
+         (uint8_t)(pResp->statusCode / 100) == (uint8_t)2;
+}
 
-  // 返回的body
-  curl_easy_setopt(hCurl, CURLOPT_WRITEFUNCTION, curlRespBodyCallback);
-  curl_easy_setopt(hCurl, CURLOPT_WRITEDATA, pResponse);
+LoadProfile::LoadProfile(const vector<Stage>& stages, double initial)
+    : stages{stages}, initial{initial} {
+  chrono::milliseconds end{0};
+  for (auto&& it : stages) {
+    end += it.duration;
+    ends.push_back(end);
+  }
+}
 
-  // 返回的headers
-  curl_easy_setopt(hCurl, CURLOPT_HEADERFUNCTION, curlRespHeaderCallback);
-  curl_easy_setopt(hCurl, CURLOPT_HEADERDATA, pResponse);
+// 当前阶段，全部结束后返回 Size()
+size_t LoadProfile::StageIndex(chrono::steady_clock::time_point now) {
+  auto elapsed = now - startTime;
+  for (size_t i = 0; i < ends.size(); i++)
+    if (elapsed < ends[i]) return i;
+  return ends.size();
 }
 
-HttpClint::~HttpClint() {
-  if (pResponse != nullptr) delete pResponse;
+double LoadProfile::Target(chrono::steady_clock::time_point now) {
+  auto index = StageIndex(now);
+  if (index >= stages.size()) return stages.empty() ? 0 : stages.back().target;
+
+  double from = index ? stages[index - 1].target : initial;
+  double to = stages[index].target;
+  auto& stage = stages[index];
+  if (stage.duration.count() == 0) return to;
+
+  double progress =
+      chrono::duration<double, milli>(now - startTime -
+                                      (ends[index] - stage.duration))
+          .count() /
+      stage.duration.count();
+  return from + (to - from) * progress;
+}
 
-  if (pHeaerSlist != nullptr) curl_slist_free_all(pHeaerSlist);
+double LoadProfile::MaxTarget() {
+  double target = 0;
+  for (auto&& it : stages) target = max(target, it.target);
+  return target;
+}
 
-  if (pMultipart != nullptr) curl_mime_free(pMultipart);
+void Worker::UpdateStage(chrono::steady_clock::time_point now) {
+  if (pProfile == nullptr) return;
 
-  if (hCurl != nullptr) curl_easy_cleanup(hCurl);
+  auto index = pProfile->StageIndex(now);
+  pStage = index < stageStats.size() ? &stageStats[index] : nullptr;
 }
 
-inline void HttpClint::SetUrl() {
-  if (pRequest->url.empty()) {
-    cerr << "Error: request url empty" << endl;
-    exit(1);
-  }
-  curl_easy_setopt(hCurl, CURLOPT_URL, pRequest->url.data());
-  curl_easy_setopt(hCurl, CURLOPT_SSL_VERIFYPEER, 0L);
-  curl_easy_setopt(hCurl, CURLOPT_SSL_VERIFYHOST, 0L);
-  curl_easy_setopt(hCurl, CURLOPT_SSL_VERIFYSTATUS, 0L);
-  // curl_easy_setopt(hCurl, CURLOPT_DOH_SSL_VERIFYPEER, 0L);
-  // curl_easy_setopt(hCurl, CURLOPT_DOH_SSL_VERIFYHOST, 0L);
-  // curl_easy_setopt(hCurl, CURLOPT_DOH_SSL_VERIFYSTATUS, 0L);
+bool Worker::Finished(chrono::steady_clock::time_point now) {
+  return pProfile != nullptr && pProfile->Finished(now);
 }
 
-inline void HttpClint::SetMethod() {
-  auto m = pRequest->Method();
-  CURLcode code = CURLE_OK;
+// 领一个请求，票据领完或者时间到了返回 false
+bool Worker::Take(chrono::steady_clock::time_point now) {
+  if (Finished(now)) return false;
+  UpdateStage(now);
 
-  switch (m) {
-    case METHOD::Head:
-      code = curl_easy_setopt(hCurl, CURLOPT_NOBODY, 1L);
-      break;
+  return pTickets->Take(id);
+}
 
-    case METHOD::Get:
-      code = curl_easy_setopt(hCurl, CURLOPT_HTTPGET, 1L);
-      break;
+// 闭环模式当前应该使用的连接数
+uint32_t Worker::TargetConnections(chrono::steady_clock::time_point now) {
+  if (pProfile == nullptr || rate > 0) return connectionCount;
 
-    case METHOD::Post:
-      code = curl_easy_setopt(hCurl, CURLOPT_POST, 1L);
-      break;
+  auto total = (uint32_t)llround(max(pProfile->Target(now), 0.0));
+  auto share = total / threadCount + (id < total % threadCount);
+  return min(share, connectionCount);
+}
 
-    case METHOD::Delete:
-      code = curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, "DELETE");
-      break;
+// 开环模式当前的速率
+double Worker::TargetRate(chrono::steady_clock::time_point now) {
+  if (pProfile == nullptr || pProfile->Size() == 0) return rate;
+  return pProfile->Target(now) / threadCount;
+}
 
-    case METHOD::Put:
-      code = curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, "PUT");
-      break;
+void Worker::Snapshot(ThreadResult* pThreadResult) {
+  pThreadResult->cpu = cpu;
+  pThreadResult->connectionCount = connectionCount;
+  pThreadResult->time =
+      chrono::duration_cast<chrono::milliseconds>(endTime - startTime);
+  pThreadResult->setupTime = setupTime;
+  pThreadResult->luaTime = luaTime;
+  pThreadResult->gcTime = gcTime;
+  pThreadResult->luaMemoryKB = luaMemoryKB;
+  pThreadResult->requestedCount =
+      (uint32_t)stats.requestedCount.load(memory_order_relaxed);
+  pThreadResult->successCount =
+      (uint32_t)stats.successCount.load(memory_order_relaxed);
+  pThreadResult->errorCount =
+      (uint32_t)stats.errorCount.load(memory_order_relaxed);
+  pThreadResult->respDataCount =
+      (size_t)stats.respDataCount.load(memory_order_relaxed);
+  pThreadResult->connectCount =
+      stats.connectCount.load(memory_order_relaxed);
+  pThreadResult->lateCount = stats.lateCount.load(memory_order_relaxed);
+  pThreadResult->droppedCount = stats.droppedCount.load(memory_order_relaxed);
+}
 
-    case METHOD::Patch:
-      code = curl_easy_setopt(hCurl, CURLOPT_CUSTOMREQUEST, "PATCH");
-      break;
+// 发送前准备，有 lua Request 函数时先生成请求，生成时间不算在延迟里
+static inline void nextRequest(Worker* pWorker, HttpClint* pClint) {
+  bool hasSpec = pWorker->luaRequest || pWorker->pCorpus != nullptr;
+  if (pWorker->pRequest->templates.active)
+    pClint->ApplyTemplates(&pWorker->templateState, !hasSpec);
+
+  if (pWorker->luaRequest) {
+    pWorker->pLocalScript->NextRequest(&pClint->spec);
+    pClint->ApplySpec();
+  } else if (pWorker->pCorpus != nullptr) {
+    // body 直接指向映射，url 需要 \0 结尾
+    pClint->specScratch.clear();
+    pWorker->pCorpus->Parse(pWorker->corpusCursor.Take(), &pClint->spec,
+                            &pClint->specScratch);
+    if (!pClint->spec.url.empty()) {
+      pClint->specUrl.assign(pClint->spec.url);
+      pClint->spec.url = pClint->specUrl;
+    }
+    pClint->ApplySpec();
+  }
+  pClint->Clear();
+}
 
-    default:
-      cerr << "Error: set method not match " << (int)m << endl;
+// 回放日志里的一个请求，相对路径拼在 -u 的 scheme://host 后面
+static inline void replayRequest(Worker* pWorker, HttpClint* pClint,
+                                 size_t index) {
+  if (pWorker->pRequest->templates.active)
+    pClint->ApplyTemplates(&pWorker->templateState, false);
+
+  // 加载时已经检查过格式，body 直接指向映射
+  auto pReplay = pWorker->pReplay;
+  pClint->specScratch.clear();
+  parseReplayLine(pReplay->Line(index), &pClint->spec, &pClint->specScratch,
+                  nullptr);
+
+  auto url = pClint->spec.url;
+  if (!url.empty() && url[0] == '/') {
+    if (pReplay->origin.empty()) {
+      cerr << "Error: replay path " << url << " needs -u" << endl;
       exit(1);
-      break;
+    }
+    pClint->specUrl.assign(pReplay->origin).append(url);
+  } else {
+    pClint->specUrl.assign(url);
   }
+  if (!url.empty()) pClint->spec.url = pClint->specUrl;
 
-  if (code != CURLE_OK) {
-    cerr << "Error: set mathod " << (int)m << " code " << code << endl;
-    exit(1);
-  }
+  pClint->ApplySpec();
+  pClint->Clear();
 }
 
-void HttpClint::SetHeader() {
-  if (pRequest->headers.empty()) return;
+// --lua-gc-step 关掉了工作线程 lua_State 的自动 GC，每个请求结束后回收一步
+// 只有 Request/RequestBatch 没有 Response 的脚本也需要
+static inline void gcStep(Worker* pWorker) {
+  if (pWorker->pLocalScript != nullptr && pWorker->pRequest->luaGcStep)
+    pWorker->pLocalScript->GcStep(pWorker->pRequest->luaGcStep);
+}
 
-  for (auto&& [k, v] : pRequest->headers)
-    pHeaerSlist =
-        curl_slist_append(pHeaerSlist, (string(k) + ":" + string(v)).c_str());
+// 一个请求结束后记录统计
+static inline void onResponseDone(Worker* pWorker, HttpClint* pClint,
+                                  CURLcode code, LuaScript* copyLuaScript) {
+  if (code) {
+    // std::cout << "Clint Send Error: " << code << std::endl;
+    pWorker->Add(&WorkerStats::errorCount);
+    gcStep(pWorker);
+    return;
+  }
 
-  curl_easy_setopt(hCurl, CURLOPT_HTTPHEADER, pHeaerSlist);
+  pWorker->RecordLatency(pClint->LatencyUs());
+
+  PhaseTimes times;
+  pClint->GetPhaseTimes(&times);
+  pWorker->phases.Record(times);
+  pWorker->Add(&WorkerStats::connectCount, times.numConnects);
+
+  auto pResp = pClint->GetResponsePtr();
+  pWorker->Add(&WorkerStats::respDataCount, pResp->size);
+  pWorker->statusCounts[clamp(pResp->statusCode, 0L, 599L)]++;
+
+  if (isResponseSuccess(pResp, copyLuaScript, &pWorker->pRequest->assertions))
+    pWorker->Add(&WorkerStats::successCount);
+  else
+    pWorker->Add(&WorkerStats::errorCount);
+
+  // 延迟已经记录，在这里回收不会算进服务端延迟
+  gcStep(pWorker);
 }
 
-void HttpClint::SetBody() {
-  if (!pRequest->multipart.empty()) {
-    pMultipart = curl_mime_init(hCurl);
+void blockHttpSend(Worker* pWorker) {
+  auto pRequest = pWorker->pRequest;
+  LuaScript* copyLuaScript =
+      pWorker->luaResponse ? pWorker->pLocalScript : nullptr;
 
-    curl_mimepart* part = nullptr;
+  HttpClint clint{pRequest};
 
-    for (auto&& i : pRequest->multipart) {
-      auto name = i.name;
-      for (auto&& value : i.values) {
-        if (i.isFilePath) {
-          filesystem::path p{value};
+  pWorker->startTime = chrono::steady_clock::now();
+  while (pWorker->Take(chrono::steady_clock::now())) {
+    pWorker->Add(&WorkerStats::requestedCount);
 
-          part = curl_mime_addpart(pMultipart);
-          curl_mime_name(part, name.data());
-          curl_mime_filedata(part, p.filename().string().c_str());
+    nextRequest(pWorker, &clint);
+    onResponseDone(pWorker, &clint, clint.Send(), copyLuaScript);
+  }
+  pWorker->endTime = chrono::steady_clock::now();
+}
 
-          FILE* file = fopen(p.string().c_str(), "rb");
-          if (!file) {
-            cerr << "Error: open file " << p << endl;
-            exit(1);
-          }
-          curl_mime_data_cb(part, filesystem::file_size(p),
-                            (curl_read_callback)fread,
-                            (curl_seek_callback)fseek, NULL, file);
-        } else {
-          part = curl_mime_addpart(pMultipart);
-          curl_mime_name(part, name.data());
-          // CURL_ZERO_TERMINATED 特殊size_t值，表示以空结尾的字符串
-          curl_mime_data(part, value.data(), CURL_ZERO_TERMINATED);
-        }
+void multiHttpSend(Worker* pWorker) {
+  auto pRequest = pWorker->pRequest;
+  LuaScript* copyLuaScript =
+      pWorker->luaResponse ? pWorker->pLocalScript : nullptr;
+
+  MultiLoop loop;
+  vector<unique_ptr<HttpClint>> clints;
+  vector<HttpClint*> idle;
+  bool done = false;
+
+  for (uint32_t i = 0; i < pWorker->connectionCount; i++) {
+    clints.push_back(make_unique<HttpClint>(pRequest));
+    idle.push_back(clints.back().get());
+  }
+
+  // 按当前阶段的连接数补齐正在发送的请求
+  auto fill = [&](chrono::steady_clock::time_point now) {
+    auto target = pWorker->TargetConnections(now);
+    while (!done && !idle.empty() && loop.Inflight() < target) {
+      if (!pWorker->Take(now)) {
+        done = true;
+        break;
       }
+
+      pWorker->Add(&WorkerStats::requestedCount);
+
+      auto pClint = idle.back();
+      idle.pop_back();
+      nextRequest(pWorker, pClint);
+      loop.Add(pClint);
     }
+  };
 
-    curl_easy_setopt(hCurl, CURLOPT_MIMEPOST, pMultipart);
-  }
+  pWorker->startTime = chrono::steady_clock::now();
+  fill(pWorker->startTime);
 
-  if (!pRequest->data.empty()) {
-    curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, pRequest->data.size());
-    curl_easy_setopt(hCurl, CURLOPT_POSTFIELDS, pRequest->data.data());
-  } else {
-    curl_easy_setopt(hCurl, CURLOPT_POSTFIELDSIZE, 0);
-  }
-}
+  // 有负载阶段时定期醒来调整连接数
+  int maxWaitMs = pWorker->pProfile != nullptr ? 10 : -1;
 
-CURLcode HttpClint::Send() { return curl_easy_perform(hCurl); }
+  CURLcode code;
+  while (loop.Inflight() > 0 || (!done && pWorker->pProfile != nullptr)) {
+    if (loop.Inflight() > 0)
+      loop.Wait(maxWaitMs);
+    else
+      this_thread::sleep_for(chrono::milliseconds(maxWaitMs));
 
-// 清理上一次请求的返回结果
-inline void HttpClint::Clear() { pResponse->Clear(); }
+    HttpClint* pClint;
+    while ((pClint = loop.Done(&code)) != nullptr) {
+      onResponseDone(pWorker, pClint, code, copyLuaScript);
+      idle.push_back(pClint);
+    }
 
-inline Response* HttpClint::GetResponsePtr() {
-  curl_easy_getinfo(hCurl, CURLINFO_RESPONSE_CODE, &pResponse->statusCode);
-  return pResponse;
+    auto now = chrono::steady_clock::now();
+    if (pWorker->Finished(now)) done = true;
+    fill(now);
+  }
+  pWorker->endTime = chrono::steady_clock::now();
+
+  clints.clear();
 }
 
-void blockHttpSend(Request* pRequest, LuaScript* pLuaScript) {
-  LuaScript* copyLuaScript{nullptr};
+// 开环模式：按计划时间发请求，不等上一个请求返回
+// 没有空闲连接时进入积压队列，延迟从计划时间算起，避免 coordinated omission
+// --replay 时计划时间来自日志，积压的请求记住自己在日志里的位置
+void rateHttpSend(Worker* pWorker) {
+  auto pRequest = pWorker->pRequest;
+  LuaScript* copyLuaScript =
+      pWorker->luaResponse ? pWorker->pLocalScript : nullptr;
+
+  MultiLoop loop;
+  vector<unique_ptr<HttpClint>> clints;
+  vector<HttpClint*> idle;
+  deque<pair<chrono::steady_clock::time_point, size_t>> backlog;
+  size_t maxBacklog = (size_t)pWorker->connectionCount * 10;
+
+  const auto lateThreshold = chrono::milliseconds(1);
+  mt19937_64 rng{pWorker->id + 1};
+  exponential_distribution<double> arrival{1};
+
+  // 从 from 开始累积速率的积分，到达 need 时发下一个请求
+  // 速率随阶段变化，每次最多按 step 推进，速率很低或为 0 时也不会一步跨过整个阶段
+  const auto step = chrono::milliseconds(10);
+  const double stepSeconds = chrono::duration<double>(step).count();
+  auto schedule = [&](chrono::steady_clock::time_point from) {
+    double need = pRequest->poisson ? arrival(rng) : 1;
+    auto t = from;
+    while (!pWorker->Finished(t)) {
+      double rate = pWorker->TargetRate(t);
+      if (rate > 0 && need / rate <= stepSeconds)
+        return t + chrono::duration_cast<chrono::steady_clock::duration>(
+                       chrono::duration<double>(need / rate));
+      need -= max(rate, 0.0) * stepSeconds;
+      t += step;
+    }
+    return t;
+  };
+
+  // 回放时 index 是下一个请求在日志里的位置
+  auto pReplay = pWorker->pReplay;
+  size_t index = 0, replayNext = pWorker->id;
 
-  bool hasRespFunc = false;
+  // 下一个请求的计划时间，日志发完返回 false
+  auto advance = [&](chrono::steady_clock::time_point* pNext) {
+    if (pReplay == nullptr) {
+      *pNext = schedule(*pNext);
+      return true;
+    }
+    if (replayNext >= pReplay->Size()) return false;
+    index = replayNext;
+    replayNext += pWorker->threadCount;
+    *pNext = pReplay->Due(index);
+    return true;
+  };
 
-  if (pLuaScript != nullptr && pLuaScript->HasResponseFunc()) {
-    copyLuaScript = pLuaScript->Copy();
-    copyLuaScript->PresetRequestVariable(pRequest);
-    copyLuaScript->PresetDoScript(pRequest);
+  auto dispatch = [&](HttpClint* pClint,
+                      chrono::steady_clock::time_point intended,
+                      size_t line) {
+    pWorker->Add(&WorkerStats::requestedCount);
+    pWorker->scheduleLag.Record((uint64_t)max(
+        chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - intended)
+            .count(),
+        (chrono::microseconds::rep)0));
+
+    if (pReplay != nullptr)
+      replayRequest(pWorker, pClint, line);
+    else
+      nextRequest(pWorker, pClint);
+    pClint->SetSendTime(intended);
+    loop.Add(pClint);
+  };
 
-    hasRespFunc = copyLuaScript->HasResponseFunc();
+  for (uint32_t i = 0; i < pWorker->connectionCount; i++) {
+    clints.push_back(make_unique<HttpClint>(pRequest));
+    idle.push_back(clints.back().get());
   }
 
-  HttpClint clint{pRequest};
+  pWorker->startTime = chrono::steady_clock::now();
+  auto next = pWorker->startTime;
+  bool hasTickets = advance(&next);
+
   CURLcode code;
-  size_t _successCount{0}, _errorCount{0}, _respDataCount{0};
+  while (hasTickets || !backlog.empty() || loop.Inflight() > 0) {
+    auto now = chrono::steady_clock::now();
+    pWorker->UpdateStage(now);
+
+    // 时间到了，积压的请求不再发送
+    if (pWorker->Finished(now)) {
+      hasTickets = false;
+      pWorker->Add(&WorkerStats::droppedCount, backlog.size());
+      backlog.clear();
+    }
 
-  for (; requestedCount < pRequest->requestCount;) {
-    requestedCount++;
+    // 发出所有到时间的请求
+    while (hasTickets && next <= now) {
+      if (!pWorker->Take(now)) {
+        hasTickets = false;
+        break;
+      }
 
-    clint.Clear();
+      if (!idle.empty()) {
+        if (now - next > lateThreshold) pWorker->Add(&WorkerStats::lateCount);
+        dispatch(idle.back(), next, index);
+        idle.pop_back();
+      } else if (backlog.size() < maxBacklog) {
+        backlog.push_back({next, index});
+      } else {
+        pWorker->Add(&WorkerStats::droppedCount);
+      }
 
-    code = clint.Send();
-    if (code) {
-      // std::cout << "Clint Send Error: " << code << std::endl;
-      errorCount++;
-      continue;
+      if (!advance(&next)) hasTickets = false;
     }
 
-    auto pResp = clint.GetResponsePtr();
-    _respDataCount += pResp->size;
+    int waitMs = -1;
+    if (hasTickets)
+      waitMs = (int)max(chrono::duration_cast<chrono::milliseconds>(
+                            next - chrono::steady_clock::now())
+                            .count(),
+                        (chrono::milliseconds::rep)0);
+
+    if (loop.Inflight() > 0)
+      loop.Wait(waitMs);
+    else if (waitMs > 0)
+      this_thread::sleep_until(next);
+
+    HttpClint* pClint;
+    while ((pClint = loop.Done(&code)) != nullptr) {
+      onResponseDone(pWorker, pClint, code, copyLuaScript);
+
+      // 积压的请求都已经晚了
+      if (!backlog.empty()) {
+        pWorker->Add(&WorkerStats::lateCount);
+        dispatch(pClint, backlog.front().first, backlog.front().second);
+        backlog.pop_front();
+      } else {
+        idle.push_back(pClint);
+      }
+    }
+  }
+  pWorker->endTime = chrono::steady_clock::now();
 
-    bool isSuccess = hasRespFunc
-                         ? copyLuaScript->CallResponse(pResp)
-                         : (uint8_t)(pResp->statusCode / 100) == (uint8_t)2;
+  clints.clear();
+}
 
-    if (isSuccess)
-      _successCount++;
-    else
-      _errorCount++;
+Reporter::Reporter(vector<Worker>& workers, chrono::milliseconds interval)
+    : workers{workers}, interval{interval}, prevLatency(workers.size()) {}
+
+void Reporter::Start(chrono::steady_clock::time_point startTime) {
+  this->startTime = lastTime = startTime;
+
+  hThread = thread([this] {
+    unique_lock<mutex> lock{mtx};
+    auto next = lastTime + interval;
+    while (!cv.wait_until(lock, next, [this] { return stopped; })) {
+      Tick(chrono::steady_clock::now());
+      next += interval;
+    }
+  });
+}
+
+void Reporter::Stop() {
+  {
+    lock_guard<mutex> lock{mtx};
+    stopped = true;
   }
+  cv.notify_all();
+  if (hThread.joinable()) hThread.join();
+
+  auto now = chrono::steady_clock::now();
+  if (now - lastTime >= chrono::milliseconds(1)) Tick(now);
+}
 
-  successCount += _successCount;
-  errorCount += _errorCount;
-  respDataCount += _respDataCount;
+void Reporter::Tick(chrono::steady_clock::time_point now) {
+  IntervalSnapshot snap;
+  snap.time = chrono::duration_cast<chrono::milliseconds>(now - startTime);
+  snap.interval = chrono::duration_cast<chrono::milliseconds>(now - lastTime);
+  lastTime = now;
+
+  uint64_t requested{0}, success{0}, error{0};
+  size_t respData{0};
+  Histogram latency;
+
+  for (size_t i = 0; i < workers.size(); i++) {
+    auto& stats = workers[i].stats;
+    requested += stats.requestedCount.load(memory_order_relaxed);
+    success += stats.successCount.load(memory_order_relaxed);
+    error += stats.errorCount.load(memory_order_relaxed);
+    respData += stats.respDataCount.load(memory_order_relaxed);
+
+    snapshot.CopyFrom(workers[i].latency);
+    diff.Diff(snapshot, prevLatency[i]);
+    latency.Merge(diff);
+    swap(prevLatency[i], snapshot);
+  }
 
-  if (copyLuaScript != nullptr) delete copyLuaScript;
+  snap.requestedCount = requested - prevRequested;
+  snap.successCount = success - prevSuccess;
+  snap.errorCount = error - prevError;
+  snap.respDataCount = respData - prevRespData;
+  prevRequested = requested;
+  prevSuccess = success;
+  prevError = error;
+  prevRespData = respData;
+
+  snap.latencyCount = latency.TotalCount();
+  snap.latencyMean = latency.Mean();
+  snap.latencyMax = latency.Max();
+  snap.p50 = latency.Percentile(50);
+  snap.p90 = latency.Percentile(90);
+  snap.p99 = latency.Percentile(99);
+  snap.p999 = latency.Percentile(99.9);
+
+  series.push_back(snap);
+  if (onInterval) onInterval(&series.back());
 }
 
-int run(Request* pRequest, RunResult* pResult) {
+int run(Request* pRequest, RunResult* pResult, IntervalCallback onInterval) {
   LuaScript* pLuaScript{nullptr};
 
   if (pRequest->hasScript()) {
+    // 主 lua_State 保持自动 GC，--lua-gc* 只用于工作线程的 lua_State
     pLuaScript = new LuaScript(pRequest->scirptPath, pRequest->scirptCode);
     pLuaScript->Preset(pRequest);
   }
 
-  auto threadCount = min(max(thread::hardware_concurrency(), (uint32_t)2) - 1,
-                         pRequest->requestCount);
+  // -m 和 lua 设置的方法在这里检查，不认识的方法用 CURLOPT_CUSTOMREQUEST 发送
+  if (!utils::isToken(pRequest->methodStr)) {
+    cerr << "Error: invalid method " << pRequest->methodStr << endl;
+    exit(1);
+  }
+
+  pRequest->MapUploads();
+  pRequest->templates.Compile(pRequest);
+  pRequest->assertions.Compile(&pRequest->responseHeaders);
+
+  Corpus corpus;
+  if (!pRequest->corpusPath.empty()) {
+    corpus.Load(pRequest->corpusPath, thread::hardware_concurrency());
+    pRequest->dynamic = true;
+  }
+  // 日志只在这里读一次，工作线程按位置取自己的那一份
+  Replay replay;
+  if (!pRequest->replayPath.empty()) {
+    replay.Load(pRequest->replayPath, thread::hardware_concurrency());
+    replay.speed = pRequest->replaySpeed > 0 ? pRequest->replaySpeed : 1;
+    string_view url = pRequest->url;
+    auto scheme = url.find("://");
+    auto slash = url.find('/', scheme == string_view::npos ? 0 : scheme + 3);
+    replay.origin = url.substr(0, slash);
+    pRequest->dynamic = true;
+  }
+  bool replaying = !pRequest->replayPath.empty();
+  pRequest->needflag |= pRequest->assertions.needflag;
+
+  // 工作线程只需要 Response/Request 函数，不要在线程里访问主 lua_State
+  LuaScript* pWorkerScript = nullptr;
+  if (pLuaScript != nullptr && pLuaScript->HasRequestFunc())
+    pRequest->dynamic = true;
+  if (pLuaScript != nullptr &&
+      (pLuaScript->HasResponseFunc() || pRequest->dynamic))
+    pWorkerScript = pLuaScript;
+
+  // 按时间运行或者回放时没有指定 -c 就不限制请求数
+  bool timed = pRequest->duration.count() > 0 || !pRequest->stages.empty();
+  uint32_t requestCount = (timed || replaying) && !pRequest->hasRequestCount
+                              ? UINT32_MAX
+                              : pRequest->requestCount;
+
+  // 只有 -t 时当作一个 target 不变的阶段
+  auto stages = pRequest->stages;
+  double initial = 0;
+  if (stages.empty() && pRequest->duration.count() > 0) {
+    initial = pRequest->rate > 0 ? pRequest->rate
+                                 : (double)pRequest->connections;
+    stages.push_back({pRequest->duration, initial});
+  }
+  LoadProfile profile{stages, initial};
+
+  auto connections = pRequest->connections;
+  // 开环模式和回放需要 curl_multi，没有指定 -C 时默认 64 个连接
+  if ((pRequest->rate > 0 || replaying) && connections == 0) connections = 64;
+  // 闭环模式的阶段按连接数调整，连接按最大的阶段创建
+  if (pRequest->rate <= 0 && !pRequest->stages.empty())
+    connections = max(connections, (uint32_t)ceil(profile.MaxTarget()));
+  connections = min(connections, requestCount);
+  auto threadCount =
+      pRequest->threads
+          ? pRequest->threads
+          : max(thread::hardware_concurrency(), (uint32_t)2) - 1;
+  threadCount = min(threadCount, connections ? connections : requestCount);
   vector<thread> threads;
 
+  vector<uint32_t> cpus;
+  if (pRequest->pin) {
+    cpus = utils::availableCpus(pRequest->reserveCpus);
+    if (cpus.empty()) {
+      cerr << "Error: no cpu left to pin" << endl;
+      exit(1);
+    }
+  }
+
+  TicketPool tickets{requestCount, threadCount};
+
+  vector<Worker> workers(threadCount);
+  for (uint32_t i = 0; i < threadCount; i++) {
+    auto& w = workers[i];
+    w.id = i;
+    w.pRequest = pRequest;
+    w.pLuaScript = pWorkerScript;
+    if (corpus.Size()) {
+      // rr: 线程 i 取 i, i + 线程数 ...  shard: 每个线程连续的一段
+      auto n = corpus.Size();
+      w.pCorpus = &corpus;
+      if (pRequest->corpusShard && n >= threadCount) {
+        w.corpusCursor.begin = n * i / threadCount;
+        w.corpusCursor.end = n * (i + 1) / threadCount;
+        w.corpusCursor.next = w.corpusCursor.begin;
+        w.corpusCursor.step = 1;
+      } else {
+        w.corpusCursor.end = n;
+        w.corpusCursor.next = i % n;
+        w.corpusCursor.step = threadCount;
+      }
+    }
+    w.threadCount = threadCount;
+    w.pTickets = &tickets;
+    if (timed) {
+      w.pProfile = &profile;
+      w.stageStats = vector<WorkerStageStats>(profile.Size());
+    }
+    if (!cpus.empty()) w.cpu = cpus[i % cpus.size()];
+    // 连接数平均分给每个线程
+    if (connections)
+      w.connectionCount =
+          connections / threadCount + (i < connections % threadCount);
+    if (pRequest->rate > 0) w.rate = pRequest->rate / threadCount;
+    if (replaying) w.pReplay = &replay;
+  }
+
+  // 有 lua Interval 函数时默认每秒一次
+  auto interval = pRequest->interval;
+  bool hasIntervalFunc = pLuaScript != nullptr && pLuaScript->HasIntervalFunc();
+  if (hasIntervalFunc && interval.count() == 0)
+    interval = chrono::milliseconds(1000);
+
+  // 工作线程不会使用主 lua_State，报告线程可以调用 Interval 函数
+  Reporter reporter{workers, interval};
+  // 指定了 --interval 时调用方的回调照常调用，不被 lua 覆盖
+  if (hasIntervalFunc) {
+    if (pRequest->interval.count() == 0) onInterval = nullptr;
+    reporter.onInterval = [pLuaScript, onInterval](IntervalSnapshot* pSnapshot) {
+      if (onInterval) onInterval(pSnapshot);
+      pLuaScript->CallInterval(pSnapshot);
+    };
+  } else {
+    reporter.onInterval = onInterval;
+  }
+
+  // 所有线程准备好后再一起开始，准备时间不算在压测时间里
+  latch ready{(ptrdiff_t)threadCount};
+  latch go{1};
+
+  auto setupClock = chrono::steady_clock::now();
+  for (auto&& w : workers) {
+    auto pWorker = &w;
+    threads.push_back(thread([pWorker, &ready, &go] {
+      if (pWorker->cpu >= 0 && !utils::pinThread(pWorker->cpu))
+        cerr << "Warning: pin cpu " << pWorker->cpu << endl;
+
+      setupWorker(pWorker);
+      ready.count_down();
+      go.wait();
+
+      if (pWorker->rate > 0 || pWorker->pReplay != nullptr)
+        rateHttpSend(pWorker);
+      else if (pWorker->connectionCount)
+        multiHttpSend(pWorker);
+      else
+        blockHttpSend(pWorker);
+
+      if (auto pScript = pWorker->pLocalScript) {
+        pWorker->luaTime =
+            chrono::duration_cast<chrono::microseconds>(pScript->callTime);
+        pWorker->gcTime =
+            chrono::duration_cast<chrono::microseconds>(pScript->gcTime);
+        pWorker->luaMemoryKB = pScript->MemoryKB();
+        delete pScript;
+      }
+    }));
+  }
+  ready.wait();
+
   auto startClock = chrono::steady_clock::now();
-  for (size_t i = 0; i < threadCount; i++)
-    threads.push_back(thread(blockHttpSend, pRequest, pLuaScript));
+  profile.startTime = startClock;
+  replay.startTime = startClock;
+  if (interval.count() > 0) reporter.Start(startClock);
+  go.count_down();
+
   for (auto&& i : threads) i.join();
   auto endClock = chrono::steady_clock::now();
 
+  if (interval.count() > 0) reporter.Stop();
+  pResult->intervals = std::move(reporter.series);
+
   pResult->time =
       chrono::duration_cast<chrono::milliseconds>(endClock - startClock);
+  pResult->setupTime =
+      chrono::duration_cast<chrono::microseconds>(startClock - setupClock);
   pResult->threadCount = threadCount;
-  pResult->requestedCount = (uint32_t)requestedCount;
-  pResult->successCount = (uint32_t)successCount;
-  pResult->errorCount = (uint32_t)errorCount;
-  pResult->respDataCount = (size_t)respDataCount;
+  pResult->connectionCount = connections;
+  pResult->requestedCount = 0;
+  pResult->successCount = 0;
+  pResult->errorCount = 0;
+  pResult->respDataCount = 0;
+  pResult->connectCount = 0;
+  pResult->rate = pRequest->rate;
+  pResult->lateCount = 0;
+  pResult->droppedCount = 0;
+  pResult->latency.Reset();
+  pResult->scheduleLag.Reset();
+  pResult->phases.Reset();
+
+  // 合并每个线程的统计
+  pResult->threads.assign(threadCount, ThreadResult{});
+  for (uint32_t i = 0; i < threadCount; i++) {
+    auto& it = pResult->threads[i];
+    workers[i].Snapshot(&it);
+    pResult->requestedCount += it.requestedCount;
+    pResult->successCount += it.successCount;
+    pResult->errorCount += it.errorCount;
+    pResult->respDataCount += it.respDataCount;
+    pResult->connectCount += it.connectCount;
+    pResult->lateCount += it.lateCount;
+    pResult->droppedCount += it.droppedCount;
+    pResult->luaTime += it.luaTime;
+    pResult->gcTime += it.gcTime;
+    pResult->luaMemoryKB += it.luaMemoryKB;
+    pResult->latency.Merge(workers[i].latency);
+    pResult->scheduleLag.Merge(workers[i].scheduleLag);
+    pResult->phases.Merge(workers[i].phases);
+    for (long code = 0; code < 600; code++)
+      if (workers[i].statusCounts[code])
+        pResult->statusCounts[code] += workers[i].statusCounts[code];
+  }
+
+  // 合并每个阶段的统计
+  pResult->stages.assign(profile.Size(), StageResult{});
+  chrono::milliseconds stageStart{0};
+  for (size_t i = 0; i < profile.Size(); i++) {
+    auto& it = pResult->stages[i];
+    it.duration = profile.At(i).duration;
+    it.elapsed = clamp(pResult->time - stageStart, chrono::milliseconds(0),
+                       it.duration);
+    it.target = profile.At(i).target;
+    stageStart += it.duration;
+    for (auto&& w : workers) {
+      auto& stats = w.stageStats[i].stats;
+      it.requestedCount += stats.requestedCount.load(memory_order_relaxed);
+      it.successCount += stats.successCount.load(memory_order_relaxed);
+      it.errorCount += stats.errorCount.load(memory_order_relaxed);
+      it.respDataCount += stats.respDataCount.load(memory_order_relaxed);
+      it.latency.Merge(w.stageStats[i].latency);
+    }
+  }
 
   if (pLuaScript != nullptr && pLuaScript->HasRunDoneFunc()) {
     pResult->hasRunDone = true;
@@ -837,4 +4611,145 @@ int run(Request* pRequest, RunResult* pResult) {
   return 0;
 }
 
+void writeResultJson(ostream& out, Request* pRequest, RunResult* pResult) {
+  // 配置只有几个字段，直接用 json 对象
+  json config = {
+      {"method", pRequest->methodStr},
+      {"url", pRequest->url},
+      {"requestCount", pRequest->hasRequestCount ? pRequest->requestCount : 0},
+      {"connections", pResult->connectionCount},
+      {"threads", pResult->threadCount},
+      {"rate", pRequest->rate},
+      {"arrival", pRequest->poisson ? "poisson" : "constant"},
+      {"replay", pRequest->replayPath},
+      {"replaySpeed", pRequest->replaySpeed},
+      {"durationMs", pRequest->duration.count()},
+      {"script", pRequest->scirptPath},
+  };
+  config["headers"] = json::object();
+  for (auto&& [k, v] : pRequest->headers) config["headers"][string(k)] = v;
+  config["stages"] = json::array();
+  for (auto&& it : pRequest->stages)
+    config["stages"].push_back(
+        {{"durationMs", it.duration.count()}, {"target", it.target}});
+
+  out << "{\"config\":" << config.dump();
+
+  json totals = {
+      {"timeMs", pResult->time.count()},
+      {"setupUs", pResult->setupTime.count()},
+      {"luaUs", pResult->luaTime.count()},
+      {"luaGcUs", pResult->gcTime.count()},
+      {"luaMemoryKB", pResult->luaMemoryKB},
+      {"requestedCount", pResult->requestedCount},
+      {"successCount", pResult->successCount},
+      {"errorCount", pResult->errorCount},
+      {"respDataCount", pResult->respDataCount},
+      {"connectCount", pResult->connectCount},
+      {"lateCount", pResult->lateCount},
+      {"droppedCount", pResult->droppedCount},
+      {"rps", pResult->time.count() ? pResult->requestedCount * 1000.0 /
+                                          pResult->time.count()
+                                    : 0},
+  };
+  out << ",\"totals\":" << totals.dump();
+
+  out << ",\"statusCodes\":{";
+  bool first = true;
+  for (auto&& [code, count] : pResult->statusCounts) {
+    if (!first) out << ',';
+    first = false;
+    out << '"' << code << "\":" << count;
+  }
+  out << '}';
+
+  out << ",\"latency\":";
+  pResult->latency.WriteJson(out);
+
+  out << ",\"scheduleLag\":";
+  pResult->scheduleLag.WriteJson(out);
+
+  out << ",\"phases\":{";
+  first = true;
+  for (auto&& [name, pHistogram] : pResult->phases.Items()) {
+    if (!first) out << ',';
+    first = false;
+    out << '"' << name << "\":";
+    pHistogram->WriteJson(out);
+  }
+  out << '}';
+
+  out << ",\"stages\":[";
+  for (size_t i = 0; i < pResult->stages.size(); i++) {
+    auto& it = pResult->stages[i];
+    if (i) out << ',';
+    auto stage = json({
+                          {"durationMs", it.duration.count()},
+                          {"elapsedMs", it.elapsed.count()},
+                          {"target", it.target},
+                          {"requestedCount", it.requestedCount},
+                          {"successCount", it.successCount},
+                          {"errorCount", it.errorCount},
+                          {"respDataCount", it.respDataCount},
+                          {"rps", it.Rps()},
+                      })
+                     .dump();
+    // 去掉最后的 } 再接上 latency
+    stage.pop_back();
+    out << stage << ",\"latency\":";
+    it.latency.WriteJson(out);
+    out << '}';
+  }
+  out << ']';
+
+  out << ",\"intervals\":[";
+  for (size_t i = 0; i < pResult->intervals.size(); i++) {
+    auto& it = pResult->intervals[i];
+    if (i) out << ',';
+    out << json({
+                    {"timeMs", it.time.count()},
+                    {"intervalMs", it.interval.count()},
+                    {"requestedCount", it.requestedCount},
+                    {"successCount", it.successCount},
+                    {"errorCount", it.errorCount},
+                    {"respDataCount", it.respDataCount},
+                    {"rps", it.Rps()},
+                    {"errorRate", it.ErrorRate()},
+                    {"bytesPerSecond", it.BytesPerSecond()},
+                    {"latency",
+                     {{"count", it.latencyCount},
+                      {"mean", it.latencyMean},
+                      {"max", it.latencyMax},
+                      {"p50", it.p50},
+                      {"p90", it.p90},
+                      {"p99", it.p99},
+                      {"p999", it.p999}}},
+                })
+               .dump();
+  }
+  out << ']';
+
+  out << ",\"threads\":[";
+  for (size_t i = 0; i < pResult->threads.size(); i++) {
+    auto& it = pResult->threads[i];
+    if (i) out << ',';
+    out << json({
+                    {"cpu", it.cpu},
+                    {"connectionCount", it.connectionCount},
+                    {"timeMs", it.time.count()},
+                    {"setupUs", it.setupTime.count()},
+                    {"luaUs", it.luaTime.count()},
+                    {"luaGcUs", it.gcTime.count()},
+                    {"requestedCount", it.requestedCount},
+                    {"successCount", it.successCount},
+                    {"errorCount", it.errorCount},
+                    {"respDataCount", it.respDataCount},
+                    {"connectCount", it.connectCount},
+                    {"rps", it.Rps()},
+                })
+               .dump();
+  }
+  out << "]}\n";
+}
+
 }  // namespace oo
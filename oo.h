@@ -3,10 +3,18 @@
 #include <string.h>
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <condition_variable>
 #include <filesystem>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <regex>
 #include <string>
 #include <string_view>
 #include <thread>
@@ -31,6 +39,7 @@ enum class METHOD {
   Delete,
   Put,
   Patch,
+  Custom,  // 其他方法 (OPTIONS 等) 使用 CURLOPT_CUSTOMREQUEST
 };
 
 enum class NEED_FLAGS {
@@ -38,19 +47,179 @@ enum class NEED_FLAGS {
   Body = 1 << 1,
 };
 
+class Histogram;
+
+// 负载阶段，开环模式 (-R) 下 target 为每秒请求数，否则为并发连接数
+struct Stage {
+  chrono::milliseconds duration{0};
+  double target{0};
+};
+
 namespace utils {
 string_view trim(string_view src, char ignoreChar);
-void lua_pushjson(lua_State* L, const json& data);
+vector<uint32_t> parseCpuList(string_view src);
+chrono::milliseconds parseDuration(string_view src);
+size_t parseSize(string_view src);
+vector<Stage> parseStages(string_view src);
+vector<uint32_t> availableCpus(const vector<uint32_t>& reserve);
+bool pinThread(uint32_t cpu);
+// http 方法名是否是合法的 token (RFC 9110)
+bool isToken(string_view src);
+// 解析 json 直接压入 lua，不创建 json 对象，失败时返回 false 且栈不变
+bool lua_pushjson(lua_State* L, string_view src, string* pError);
+// 只压入 json pointer 指向的值，读完这个值就停止解析，没有时压入 nil
+bool lua_pushjsonpointer(lua_State* L, string_view src, string_view pointer,
+                         string* pError);
+void lua_pushhistogram(lua_State* L, Histogram& histogram);
 
+// 不区分大小写的 less，map 需要严格弱序
 struct mapComp {
   bool operator()(string_view lhs, string_view rhs) const {
-    if (lhs.size() != rhs.size()) return true;
-    for (size_t i = 0; i < lhs.size(); i++) {
-      if (::tolower((int)lhs[i]) != ::tolower((int)rhs[i])) return true;
-    }
-    return false;
+    return lexicographical_compare(
+        lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](char a, char b) {
+          return ::tolower((unsigned char)a) < ::tolower((unsigned char)b);
+        });
   }
 };
+
+bool equalsIgnoreCase(string_view lhs, string_view rhs);
+// 不区分大小写的 FNV-1a
+uint32_t hashIgnoreCase(string_view src);
+// SSE2 查找一个字节，没有返回 nullptr
+const char* findByte(const char* data, size_t size, char c);
+// SSE2 memmem，没有返回 nullptr，空 needle 返回 data（data 为 nullptr 时无法区分）
+const char* findBytes(const char* data, size_t size, const char* needle,
+                      size_t needleSize);
+
+// json::sax_parse 的 handler，每个值直接变成 lua 值，数组从 0 开始
+class LuaJsonSax : public json::json_sax_t {
+ private:
+  lua_State* L;
+  vector<lua_Integer> arrayIndexes;  // 每一层容器，对象为 -1
+
+  bool Store();
+  bool Open(bool isArray, size_t elements);
+
+ public:
+  std::string error;
+
+  LuaJsonSax(lua_State* L);
+  bool null() override;
+  bool boolean(bool val) override;
+  bool number_integer(json::number_integer_t val) override;
+  bool number_unsigned(json::number_unsigned_t val) override;
+  bool number_float(json::number_float_t val, const std::string& s) override;
+  bool string(json::string_t& val) override;
+  bool binary(json::binary_t& val) override;
+  bool start_object(size_t elements) override;
+  bool key(json::string_t& val) override;
+  bool end_object() override;
+  bool start_array(size_t elements) override;
+  bool end_array() override;
+  bool parse_error(size_t position, const std::string& lastToken,
+                   const json::exception& ex) override;
+};
+
+// 目标值构建成 json 对象，给 C++ 里的断言使用
+class JsonDomSax : public json::json_sax_t {
+ private:
+  nlohmann::detail::json_sax_dom_parser<json> dom;
+
+ public:
+  JsonDomSax(json& result);
+  bool null() override;
+  bool boolean(bool val) override;
+  bool number_integer(json::number_integer_t val) override;
+  bool number_unsigned(json::number_unsigned_t val) override;
+  bool number_float(json::number_float_t val, const std::string& s) override;
+  bool string(json::string_t& val) override;
+  bool binary(json::binary_t& val) override;
+  bool start_object(size_t elements) override;
+  bool key(json::string_t& val) override;
+  bool end_object() override;
+  bool start_array(size_t elements) override;
+  bool end_array() override;
+  bool parse_error(size_t position, const std::string& lastToken,
+                   const json::exception& ex) override;
+};
+
+// 目标值和预先解析好的标量比较，不构建 json 对象，目标是容器时不相等
+class JsonScalarEqualSax : public json::json_sax_t {
+ private:
+  const json& expected;
+
+ public:
+  bool equal{false};
+
+  JsonScalarEqualSax(const json& expected);
+  bool null() override;
+  bool boolean(bool val) override;
+  bool number_integer(json::number_integer_t val) override;
+  bool number_unsigned(json::number_unsigned_t val) override;
+  bool number_float(json::number_float_t val, const std::string& s) override;
+  bool string(json::string_t& val) override;
+  bool binary(json::binary_t& val) override;
+  bool start_object(size_t elements) override;
+  bool key(json::string_t& val) override;
+  bool end_object() override;
+  bool start_array(size_t elements) override;
+  bool end_array() override;
+  bool parse_error(size_t position, const std::string& lastToken,
+                   const json::exception& ex) override;
+};
+
+// "/a/0/b~1c" 拆成 token，可以提前解析好给多个 JsonPointerSax 使用
+struct JsonPointer {
+  vector<std::string> tokens;
+  vector<lua_Integer> indexes;  // token 作为数组下标，不是下标为 -1
+  bool Parse(string_view pointer);
+};
+
+// 按 json pointer 匹配路径，只把目标值交给 pInner，读完就返回 false 停止
+class JsonPointerSax {
+ private:
+  struct Frame {
+    bool isArray;
+    bool onPath;  // 这个容器在目标路径上
+    lua_Integer index;
+  };
+
+  JsonPointer ownPointer;  // SetPointer 解析的 pointer
+  const JsonPointer* pPointer{&ownPointer};
+  vector<Frame> frames;
+  bool keyMatches{false};
+  size_t captureDepth{0};
+  json::json_sax_t* pInner;
+
+  bool Begin(bool* pOnPath);
+  bool IsTarget();
+  bool Finish();
+  bool OpenContainer(bool isArray, size_t elements);
+  bool CloseContainer();
+
+ public:
+  bool found{false};
+  std::string error;
+
+  JsonPointerSax(json::json_sax_t* pInner);
+  // 使用提前解析好的 pointer，不再拆分 token
+  JsonPointerSax(json::json_sax_t* pInner, const JsonPointer* pPointer);
+  bool SetPointer(string_view pointer);
+  bool null();
+  bool boolean(bool val);
+  bool number_integer(json::number_integer_t val);
+  bool number_unsigned(json::number_unsigned_t val);
+  bool number_float(json::number_float_t val, const std::string& s);
+  bool string(json::string_t& val);
+  bool binary(json::binary_t& val);
+  bool start_object(size_t elements);
+  bool key(json::string_t& val);
+  bool end_object();
+  bool start_array(size_t elements);
+  bool end_array();
+  bool parse_error(size_t position, const std::string& lastToken,
+                   const json::exception& ex);
+};
 }  // namespace utils
 
 struct FilePart {
@@ -59,16 +228,236 @@ struct FilePart {
   bool isFilePath;
 };
 
+class Response;
+
+/**
+ * --expect-* 响应断言
+ * 运行前编译成 predicate 列表，请求完成后直接在 C++ 里判断，不需要 lua
+ */
+class Assertions {
+ private:
+  vector<pair<string, string>> specs;  // { kind, arg }
+  vector<function<bool(Response*)>> predicates;
+
+ public:
+  bool hasStatus{false};  // 指定了状态码时不再要求 2xx
+  uint8_t needflag{0};
+
+  void Add(string_view kind, string_view arg);
+  void AddFile(string_view path);
+  void Compile(vector<pair<uint32_t, string>>* pCaptureHeaders);
+  inline bool Empty() { return specs.empty(); }
+  inline bool Check(Response* pResp) {
+    for (auto&& it : predicates)
+      if (!it(pResp)) return false;
+    return true;
+  }
+};
+
+// 模板展开的状态，每个线程一份，线程之间不共享
+struct TemplateState {
+  uint64_t seq{0};   // 当前请求的 {{seq}}
+  uint64_t step{1};  // 线程 i 使用 i, i + step, i + 2 * step ...
+  uint64_t rng{0};
+
+  // splitmix64
+  inline uint64_t Next() {
+    uint64_t z = (rng += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+};
+
+/**
+ * {{seq}} {{rand:min:max}} {{uuid}} {{csv:file:column}}
+ * 编译成字面量和生成器交替的片段，展开时只需要格式化生成器的部分
+ */
+class Template {
+ public:
+  enum class Kind { Literal, Seq, Rand, Uuid, Csv };
+  struct Segment {
+    Kind kind{Kind::Literal};
+    string_view literal;
+    int64_t min{0};
+    uint64_t range{0};
+    shared_ptr<vector<string>> column;  // csv 的一列，所有线程共享只读
+  };
+
+  vector<Segment> segments;
+
+  void Compile(string_view src);
+  inline bool HasSlots() const {
+    return any_of(segments.begin(), segments.end(),
+                  [](auto&& it) { return it.kind != Kind::Literal; });
+  }
+  void Expand(TemplateState* pState, string* pOut) const;
+};
+
+// -u -d -h 里的模板，run 开始前编译
+struct RequestTemplates {
+  Template url;
+  Template data;
+  vector<pair<string_view, Template>> headers;
+  bool hasUrlSlots{false};
+  bool hasDataSlots{false};
+  bool hasHeaderSlots{false};
+  bool active{false};
+
+  void Compile(class Request* pRequest);
+};
+
+// 只读映射整个文件，可以在线程之间共享
+class MappedFile {
+ private:
+  const char* data{nullptr};
+  size_t size{0};
+#ifdef _WIN32
+  void* hFile{nullptr};
+  void* hMapping{nullptr};
+#endif
+
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  bool Open(string_view path);
+  void Close();
+  inline const char* Data() const { return data; }
+  inline size_t Size() const { return size; }
+  inline string_view View() const { return string_view(data, size); }
+};
+
+// 一个连接上传 -dF 文件时的读位置，每个请求从头读共享的映射
+struct UploadCursor {
+  const MappedFile* pFile{nullptr};
+  size_t offset{0};
+};
+
+/**
+ * lua Request/RequestBatch、--corpus、--replay 生成的一个请求
+ * 没有的字段使用 Request 的设置，字符串指向 lua_State 或者文件里的内容
+ * lua 的字符串在 ref 释放之前一直有效
+ */
+struct RequestSpec {
+  int ref{LUA_NOREF};
+  string_view method;
+  string_view url;
+  string_view body;
+  bool hasBody{false};
+  vector<pair<string_view, string_view>> headers;
+};
+
+// 解析一行 json 请求 {"method","url","headers","body"}，其他字段跳过
+// pTs 不为空时读取 "ts" 时间戳 (秒)
+bool parseRequestLine(string_view line, RequestSpec* pSpec,
+                      deque<string>* pScratch, double* pTs = nullptr);
+
+/**
+ * --corpus 请求语料，每行一个 json:
+ * {"method":"POST","url":"http://...","headers":{"k":"v"},"body":"..."}
+ * 只建立行偏移表，发送时再从映射里解析这一行，不创建 json 对象
+ */
+class Corpus {
+ private:
+  MappedFile file;
+  vector<uint64_t> offsets;  // 每行的开始位置，最后一个是文件结尾
+
+ public:
+  // 只建立行偏移表
+  void Index(string_view path, uint32_t threadCount);
+  // 建立偏移表并检查每一行，格式错误在开始前报告
+  void Load(string_view path, uint32_t threadCount);
+  inline size_t Size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+  string_view Line(size_t index) const;
+  // 字符串有转义时解码到 pScratch，否则直接指向映射
+  void Parse(size_t index, RequestSpec* pSpec, deque<string>* pScratch) const;
+};
+
+// 一个线程在语料里的位置，rr: id, id + step ... shard: [begin, end) 循环
+struct CorpusCursor {
+  uint64_t next{0};
+  uint64_t begin{0};
+  uint64_t end{0};
+  uint64_t step{1};
+
+  inline uint64_t Take() {
+    auto index = next;
+    next += step;
+    if (next >= end) next = begin + (next - begin) % (end - begin);
+    return index;
+  }
+};
+
+// 一行 json {"ts": 秒, "method", "url", ...} 或者 common/combined 日志
+// [10/Oct/2000:13:55:36 -0700] "GET /path HTTP/1.1"
+bool parseReplayLine(string_view line, RequestSpec* pSpec,
+                     deque<string>* pScratch, double* pTs);
+
+/**
+ * --replay 按访问日志里的时间回放，所有线程共享只读
+ * 和 --corpus 一样映射文件建立行偏移表，时间戳在开始前并行解析一次
+ * 线程 i 按顺序取第 i, i + 线程数 ... 个请求
+ */
+class Replay {
+ private:
+  Corpus lines;
+  vector<double> timestamps;  // 秒
+
+ public:
+  double speed{1};  // --replay-speed 加速倍数
+  string origin;    // 相对路径拼在 -u 的 scheme://host 后面
+  chrono::steady_clock::time_point startTime;
+
+  void Load(string_view path, uint32_t threadCount);
+  inline size_t Size() const { return timestamps.size(); }
+  inline string_view Line(size_t index) const { return lines.Line(index); }
+  inline chrono::steady_clock::time_point Due(size_t index) const {
+    auto offset = (timestamps[index] - timestamps[0]) / speed;
+    return startTime + chrono::duration_cast<chrono::steady_clock::duration>(
+                           chrono::duration<double>(offset));
+  }
+};
+
 class Request {
  public:
   string_view scirptPath;
   string_view scirptCode;
+  string_view hdrPath;  // --hdr 导出延迟直方图
+  string_view outPath;  // --out 导出 json 结果
   string methodStr{"get"};
   string_view url;
   map<string_view, string_view, utils::mapComp> headers;
+  // --resp-header 需要保存的返回 header，为空时保存全部
+  vector<pair<uint32_t, string>> responseHeaders;
   string_view data;
   vector<FilePart> multipart;
+  map<string_view, MappedFile> uploads;  // -dF 的文件，只映射一次，所有连接共享
   uint32_t requestCount{1};
+  bool hasRequestCount{false};  // 是否指定了 -c，按时间运行时不限制请求数
+  chrono::milliseconds duration{0};  // -t 运行时间
+  vector<Stage> stages;              // --stages 负载阶段
+  chrono::milliseconds interval{0};  // --interval 定时输出统计
+  size_t maxBody{0};                 // --max-body 最多保存的 body 大小，0 不限制
+  size_t bodyTrim{1 << 20};  // --body-trim 超过这个容量的 body 缓冲区请求结束后释放
+  uint32_t connections{0};  // -C 并发连接数，0 为阻塞模式
+  uint32_t threads{0};      // -T 线程数，0 为自动
+  double rate{0};           // -R 每秒请求数，开环模式，0 为闭环
+  bool poisson{false};      // --arrival poisson 按泊松过程发送
+  bool pin{false};          // --pin 每个线程绑定一个 cpu
+  vector<uint32_t> reserveCpus;  // --reserve-cpus 绑定时跳过的 cpu
+  Assertions assertions;         // --expect-* 响应断言
+  string_view luaGc;             // --lua-gc gen|inc，默认 lua 自己的设置
+  size_t luaGcStep{0};  // --lua-gc-step 每个请求后手动 GC 的 KB 数，0 为自动 GC
+  uint32_t luaBatch{64};  // --lua-batch 每次调用 RequestBatch 生成的请求数
+  bool dynamic{false};    // 有 lua Request/RequestBatch 函数，每个请求可以不同
+  RequestTemplates templates;
+  string_view corpusPath;  // --corpus jsonl 请求语料
+  bool corpusShard{false};  // --corpus-mode shard 每个线程一段，默认 rr 轮流
+  string_view replayPath;   // --replay 按时间回放的访问日志
+  double replaySpeed{1};    // --replay-speed
 
   uint8_t needflag{0};
 
@@ -77,56 +466,363 @@ class Request {
 
   METHOD Method();
 
+  void AddResponseHeader(string_view name);
+  // 在创建连接之前映射 -dF 的文件
+  void MapUploads();
   bool hasScript();
 };
 
+// 不认识的方法返回 Custom，方法名在加载时用 utils::isToken 检查
+METHOD parseMethod(string_view src);
+
+// 保存 body 的缓冲区，请求之间保留容量
 struct Body {
   uint8_t* data{nullptr};
   size_t size{0};
+  size_t capacity{0};
+  bool truncated{false};  // 超过 maxBody 后剩余部分没有保存
+};
+
+// 一个返回 header，name/value 为 headerStr 中的位置
+struct HeaderField {
+  uint32_t hash;
+  uint32_t nameOffset;
+  uint32_t nameSize;
+  uint32_t valueOffset;
+  uint32_t valueSize;
 };
 
 class Response {
  public:
   uint8_t needflag;
+  size_t maxBody{0};
+  size_t bodyTrim{0};
+  const vector<pair<uint32_t, string>>* pCaptureHeaders{nullptr};
 
   long statusCode{0};
-  string headerStr;
+  string headerStr;  // 保存下来的 header 行
+  vector<HeaderField> headerFields;
   Body body;
 
   size_t size{0};  // response size (Status-Line size + header size + body size)
+  size_t bodySize{0};  // 收到的 body 大小，不受 --max-body 影响
 
   Response() = default;
-  Response(uint8_t needflag) : needflag{needflag} {}
+  Response(uint8_t needflag, size_t maxBody, size_t bodyTrim)
+      : needflag{needflag}, maxBody{maxBody}, bodyTrim{bodyTrim} {}
   ~Response();
 
   size_t WriteBody(uint8_t* data, size_t size);
   size_t WriteHeader(char* buffer, size_t size);
-  map<string_view, string_view, utils::mapComp> GetHeaders();
+  inline size_t HeaderCount() { return headerFields.size(); }
+  inline string_view HeaderName(size_t index) {
+    auto& it = headerFields[index];
+    return string_view(headerStr.data() + it.nameOffset, it.nameSize);
+  }
+  inline string_view HeaderValue(size_t index) {
+    auto& it = headerFields[index];
+    return string_view(headerStr.data() + it.valueOffset, it.valueSize);
+  }
+  // 不区分大小写，没有返回空 string_view (data 为 nullptr)
+  string_view GetHeader(string_view name);
+  string_view GetHeader(uint32_t hash, string_view name);
   inline void Clear();
 };
 
 size_t curlRespBodyCallback(void* data, size_t size, size_t nmemb, void* userp);
 size_t curlRespHeaderCallback(char* buffer, size_t size, size_t nitems,
                               void* userdata);
+size_t curlDiscardCallback(void* data, size_t size, size_t nmemb, void* userp);
+size_t curlUploadReadCallback(char* buffer, size_t size, size_t nitems,
+                              void* arg);
+int curlUploadSeekCallback(void* arg, curl_off_t offset, int origin);
+int curlMultiSocketCallback(CURL* easy, curl_socket_t s, int what,
+                            void* userp, void* socketp);
+int curlMultiTimerCallback(CURLM* multi, long timeoutMs, void* userp);
+
+// 请求票据分发，保证总共只发 total 个请求
+// 每个线程一次 fetch_add 领一批放进自己的 slot，全局领完后去偷其他线程剩下的一半
+class TicketPool {
+ private:
+  // 高32位 end，低32位 next，[next, end) 为还没发出的票据
+  struct alignas(64) Slot {
+    atomic_uint64_t range{0};
+  };
+
+  alignas(64) atomic_uint64_t claimed{0};
+  uint32_t total;
+  uint32_t batch;
+  vector<Slot> slots;
+
+  bool TakeFrom(Slot& slot);
+  bool Steal(uint32_t worker);
+
+ public:
+  TicketPool(uint32_t total, uint32_t workers);
+  bool Take(uint32_t worker);
+};
+
+// HdrHistogram 风格的 log-linear 直方图
+// 构造时按 highest 和有效位数一次分配好，Record 不会分配内存
+class Histogram {
+ private:
+  uint64_t highest;
+  int32_t sigDigits;
+  int32_t subBucketHalfCountMagnitude;
+  int32_t subBucketCount;
+  int32_t subBucketHalfCount;
+  uint64_t subBucketMask;
+  int32_t bucketCount;
+  vector<uint64_t> counts;
+
+  uint64_t totalCount{0};
+  uint64_t minValue{UINT64_MAX};
+  uint64_t maxValue{0};
+
+  inline size_t CountsIndex(uint64_t value);
+  uint64_t ValueFromIndex(size_t index);
+  uint64_t HighestEquivalent(uint64_t value);
+  uint64_t MedianEquivalent(uint64_t value);
+
+ public:
+  Histogram(uint64_t highest = 60 * 1000 * 1000, int32_t sigDigits = 3);
+
+  void Record(uint64_t value);
+  void Merge(const Histogram& other);
+  void Reset();
+
+  // 在其他线程 Record 的同时拷贝一份
+  void CopyFrom(Histogram& other);
+  // this = now - prev，得到一段时间内的直方图
+  void Diff(Histogram& now, Histogram& prev);
+
+  inline uint64_t TotalCount() { return totalCount; }
+  inline uint64_t Min() { return totalCount ? minValue : 0; }
+  inline uint64_t Max() { return maxValue; }
+  double Mean();
+  double Stdev();
+  uint64_t Percentile(double percentile);
+
+  // 输出 HdrHistogram 的 percentile distribution (.hgrm) 格式
+  // scale 为输出时除以的比例，例如记录的是微秒，scale 为 1000 时输出毫秒
+  void WritePercentiles(FILE* file, double scale);
+  // {"count", "min", ..., "p50", ..., "buckets": [[value, count], ...]}
+  void WriteJson(ostream& out);
+};
+
+// curl 的各阶段累计时间，微秒
+struct PhaseTimes {
+  curl_off_t namelookup{0};
+  curl_off_t connect{0};
+  curl_off_t appconnect{0};
+  curl_off_t pretransfer{0};
+  curl_off_t starttransfer{0};
+  curl_off_t total{0};
+  long numConnects{0};
+};
+
+// 每个阶段单独的耗时直方图，微秒
+// dns/connect/tls 只记录新建连接的请求
+struct PhaseHistograms {
+  Histogram dns;
+  Histogram connect;
+  Histogram tls;
+  Histogram pretransfer;
+  Histogram wait;  // 发出请求到收到第一个字节，服务器处理时间
+  Histogram transfer;
+  Histogram total;
+
+  void Record(const PhaseTimes& times);
+  void Merge(PhaseHistograms& other);
+  void Reset();
+  array<pair<const char*, Histogram*>, 7> Items();
+};
+
+// 按时间划分的负载曲线
+// 阶段内 target 从上一阶段的 target 线性变化到本阶段的 target，第一阶段从 initial 开始
+class LoadProfile {
+ private:
+  vector<Stage> stages;
+  double initial;
+  vector<chrono::milliseconds> ends;  // 每个阶段结束的时间
+
+ public:
+  chrono::steady_clock::time_point startTime;
+
+  LoadProfile(const vector<Stage>& stages, double initial = 0);
+
+  inline size_t Size() { return stages.size(); }
+  inline const Stage& At(size_t index) { return stages[index]; }
+  inline chrono::milliseconds Duration() {
+    return ends.empty() ? chrono::milliseconds(0) : ends.back();
+  }
+  inline bool Finished(chrono::steady_clock::time_point now) {
+    return now - startTime >= Duration();
+  }
+
+  size_t StageIndex(chrono::steady_clock::time_point now);
+  double Target(chrono::steady_clock::time_point now);
+  double MaxTarget();
+};
+
+// 一个阶段的统计
+struct StageResult {
+  chrono::milliseconds duration{0};
+  chrono::milliseconds elapsed{0};  // 实际运行的时间，提前结束时小于 duration
+  double target{0};
+  uint64_t requestedCount{0};
+  uint64_t successCount{0};
+  uint64_t errorCount{0};
+  size_t respDataCount{0};
+  Histogram latency;  // 微秒
+
+  inline double Rps() {
+    return elapsed.count() ? requestedCount * 1000.0 / elapsed.count() : 0;
+  }
+};
+
+// 一段时间内的统计
+struct IntervalSnapshot {
+  chrono::milliseconds time{0};      // 距离开始的时间
+  chrono::milliseconds interval{0};  // 这一段的长度
+  uint64_t requestedCount{0};
+  uint64_t successCount{0};
+  uint64_t errorCount{0};
+  size_t respDataCount{0};
+
+  // 微秒
+  uint64_t latencyCount{0};
+  double latencyMean{0};
+  uint64_t latencyMax{0};
+  uint64_t p50{0};
+  uint64_t p90{0};
+  uint64_t p99{0};
+  uint64_t p999{0};
+
+  inline double Rps() {
+    return interval.count() ? requestedCount * 1000.0 / interval.count() : 0;
+  }
+  inline double BytesPerSecond() {
+    return interval.count() ? respDataCount * 1000.0 / interval.count() : 0;
+  }
+  inline double ErrorRate() {
+    auto done = successCount + errorCount;
+    return done ? (double)errorCount / done : 0;
+  }
+};
+
+using IntervalCallback = function<void(IntervalSnapshot*)>;
+
+struct ThreadResult {
+  chrono::milliseconds time{0};
+  chrono::microseconds setupTime{0};  // 开始压测前的准备时间 (lua 等)
+  chrono::microseconds luaTime{0};    // lua Response 函数耗时
+  chrono::microseconds gcTime{0};     // --lua-gc-step 手动 GC 耗时
+  size_t luaMemoryKB{0};
+  int32_t cpu{-1};  // 绑定的 cpu，-1 为未绑定
+  uint32_t connectionCount{0};
+  uint32_t requestedCount{0};
+  uint32_t successCount{0};
+  uint32_t errorCount{0};
+  size_t respDataCount{0};
+  uint64_t connectCount{0};
+  uint64_t lateCount{0};
+  uint64_t droppedCount{0};
+
+  inline double Rps() {
+    return time.count() ? requestedCount * 1000.0 / time.count() : 0;
+  }
+};
 
 struct RunResult {
-  chrono::milliseconds time;
+  chrono::milliseconds time;          // 压测时间，不包含准备时间
+  chrono::microseconds setupTime{0};  // 所有线程准备完成的时间
+  chrono::microseconds luaTime{0};    // 所有线程 lua Response 函数耗时
+  chrono::microseconds gcTime{0};     // 所有线程手动 GC 耗时
+  size_t luaMemoryKB{0};
   uint32_t threadCount;
+  uint32_t connectionCount{0};
   uint32_t requestedCount;
   uint32_t successCount;
   uint32_t errorCount;
   size_t respDataCount;
+  uint64_t connectCount{0};  // 新建的连接数
+  double rate{0};            // -R 计划速率
+  uint64_t lateCount{0};     // 开环模式没按计划时间发出的请求
+  uint64_t droppedCount{0};  // 开环模式积压太多被丢弃的请求
+  Histogram latency;         // 微秒，开环模式从计划发送时间算起
+  Histogram scheduleLag;     // 微秒，开环和回放模式实际发出比计划晚多少
+  PhaseHistograms phases;
+  map<long, uint64_t> statusCounts;  // 状态码: 数量
+  vector<StageResult> stages;
+  vector<IntervalSnapshot> intervals;
+  vector<ThreadResult> threads;
   bool hasRunDone{false};
 };
 
+/**
+ * 一个 lua_State 一个内存池，lua_State 只在一个线程里使用，不需要加锁
+ * 小块按 16 字节分档，释放后挂到对应档位的空闲链表，大块直接 malloc
+ */
+class LuaPool {
+ private:
+  static constexpr size_t classStep = 16;
+  static constexpr size_t maxClassSize = 512;
+  static constexpr size_t chunkSize = 64 << 10;
+
+  array<void*, maxClassSize / classStep> freeLists{};
+  vector<void*> chunks;
+  char* chunkPos{nullptr};
+  char* chunkEnd{nullptr};
+
+  static inline size_t ClassIndex(size_t size) {
+    return (size - 1) / classStep;
+  }
+  void* Malloc(size_t size);
+  void Free(void* ptr, size_t size);
+
+ public:
+  LuaPool() = default;
+  LuaPool(const LuaPool&) = delete;
+  ~LuaPool();
+
+  // lua_Alloc
+  static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+};
+
 class LuaScript {
  private:
   string_view path;
   string_view code;
   lua_State* L;
+  LuaPool pool;
+  uint32_t libs{0};  // 需要打开的标准库，见 luaLibs
+  // 主线程编译一次，工作线程直接加载字节码
+  shared_ptr<const string> bytecode;
+
+  void NewState();
+  void OpenLibs();
+
+  // Response 函数和复用的 response 对象都放在 registry 里
+  int responseFuncRef{LUA_NOREF};
+  int responseObjRef{LUA_NOREF};
+  int bodyObjRef{LUA_NOREF};
+  Response* pCurrentResponse{nullptr};
+
+  // Request(ctx) 或 RequestBatch(n, ctx)
+  int requestFuncRef{LUA_NOREF};
+  int ctxRef{LUA_NOREF};
+  int batchRef{LUA_NOREF};
+  bool isBatch{false};
+  uint32_t batchSize{1};
+  lua_Integer batchPos{0};
+  uint64_t requestSeq{0};
+
+  void PrepareResponse();
 
  public:
   LuaScript(string_view path, string_view code);
+  LuaScript(const LuaScript* pMain);
   ~LuaScript();
   void PresetRequestVariable(Request* pRequest);
   void PresetDoScript(Request* pRequest);
@@ -134,10 +830,22 @@ class LuaScript {
   void PresetPreset(Request* pRequest);
   void Preset(Request* pRequest);
   bool HasResponseFunc();
+  bool HasRequestFunc();
   bool HasRunDoneFunc();
+  bool HasIntervalFunc();
   void CallRunDone(RunResult* pResult);
+  void CallInterval(IntervalSnapshot* pSnapshot);
   bool CallResponse(Response* pResponse);
   LuaScript* Copy();
+  // 只在工作线程复制出来的 lua_State 上调用，手动 GC 由 GcStep 驱动
+  void SetGc(Request* pRequest);
+  void PrepareRequest(uint32_t threadId, uint32_t batchSize);
+  void NextRequest(RequestSpec* pSpec);
+  void GcStep(size_t kb);
+
+  chrono::nanoseconds callTime{0};  // Response 函数耗时，包含其中自动触发的 GC
+  chrono::nanoseconds gcTime{0};    // GcStep 耗时
+  inline size_t MemoryKB() { return (size_t)lua_gc(L, LUA_GCCOUNT); }
 };
 
 class HttpClint {
@@ -145,23 +853,185 @@ class HttpClint {
   CURL* hCurl{nullptr};
   struct curl_slist* pHeaerSlist{nullptr};
   curl_mime* pMultipart{nullptr};
+  deque<UploadCursor> uploadCursors;
+  struct curl_slist* pSpecHeaders{nullptr};
+
+  // 模板展开的结果，一个连接一份，请求结束前一直有效
+  string urlBuf;
+  string bodyBuf;
+  vector<string> headerLines;
+  vector<curl_slist> headerNodes;
+
+ public:
+  // spec 里需要 \0 结尾或解码后的字符串
+  string specUrl;
+  deque<string> specScratch;
+
+ private:
 
   Request* pRequest{nullptr};
   Response* pResponse{nullptr};
 
+  chrono::steady_clock::time_point sendTime;
+
  public:
   HttpClint(Request* pRequest);
   ~HttpClint();
 
+  RequestSpec spec;  // lua 生成的当前请求
+  string customMethod;  // CURLOPT_CUSTOMREQUEST 需要 \0 结尾
+
   inline void SetMethod();
+  void SetMethod(METHOD m);
+  void SetMethod(string_view name);
   inline void SetUrl();
+  void ApplySpec();
+  void ApplyTemplates(TemplateState* pState, bool apply);
   void SetHeader();
   void SetBody();
   CURLcode Send();
   inline void Clear();
   inline Response* GetResponsePtr();
+  inline CURL* GetHandle();
+  inline void SetSendTime(chrono::steady_clock::time_point time);
+  inline uint64_t LatencyUs();
+  inline void GetPhaseTimes(PhaseTimes* pTimes);
+};
+
+// 一个线程一个 curl_multi，linux 下用 epoll 驱动多个 easy handle
+class MultiLoop {
+ private:
+  CURLM* hMulti{nullptr};
+  int epfd{-1};
+  chrono::steady_clock::time_point deadline;
+  bool hasDeadline{false};
+  uint32_t inflight{0};
+
+ public:
+  MultiLoop();
+  ~MultiLoop();
+
+  void Add(HttpClint* pClint);
+  void Remove(HttpClint* pClint);
+  void Wait(int maxWaitMs = -1);
+  HttpClint* Done(CURLcode* pCode);
+  inline uint32_t Inflight() { return inflight; }
+
+  void WatchSocket(curl_socket_t s, int what, void* socketp);
+  void SetTimer(long timeoutMs);
+};
+
+// 每个线程一份统计，只有本线程写，其他线程随时可以读快照
+struct alignas(64) WorkerStats {
+  atomic_uint64_t requestedCount{0};
+  atomic_uint64_t successCount{0};
+  atomic_uint64_t errorCount{0};
+  atomic_uint64_t respDataCount{0};
+  atomic_uint64_t connectCount{0};
+  atomic_uint64_t lateCount{0};
+  atomic_uint64_t droppedCount{0};
+
+  // 单写者，不需要 lock 前缀的原子加
+  static inline void Add(atomic_uint64_t& counter, uint64_t n = 1) {
+    counter.store(counter.load(memory_order_relaxed) + n,
+                  memory_order_relaxed);
+  }
+};
+
+struct WorkerStageStats {
+  WorkerStats stats;
+  Histogram latency;
+};
+
+struct Worker {
+  uint32_t id{0};
+  uint32_t threadCount{1};
+  int32_t cpu{-1};
+  uint32_t connectionCount{0};
+  double rate{0};
+  Request* pRequest{nullptr};
+  LuaScript* pLuaScript{nullptr};
+  LuaScript* pLocalScript{nullptr};  // 本线程的 lua_State，从 pLuaScript 复制
+  bool luaResponse{false};           // pLocalScript 有 Response 函数
+  bool luaRequest{false};            // pLocalScript 有 Request/RequestBatch 函数
+  TemplateState templateState;
+  Corpus* pCorpus{nullptr};
+  CorpusCursor corpusCursor;
+  Replay* pReplay{nullptr};
+  TicketPool* pTickets{nullptr};
+  LoadProfile* pProfile{nullptr};
+  chrono::steady_clock::time_point startTime;
+  chrono::steady_clock::time_point endTime;
+  chrono::microseconds setupTime{0};
+  chrono::microseconds luaTime{0};
+  chrono::microseconds gcTime{0};
+  size_t luaMemoryKB{0};
+
+  WorkerStats stats;
+  Histogram latency;  // 微秒
+  Histogram scheduleLag;  // 微秒，实际发出比计划晚多少
+  PhaseHistograms phases;
+  array<uint64_t, 600> statusCounts{};
+
+  // 每个负载阶段一份，pStage 指向当前阶段
+  vector<WorkerStageStats> stageStats;
+  WorkerStageStats* pStage{nullptr};
+
+  inline void Add(atomic_uint64_t WorkerStats::*counter, uint64_t n = 1) {
+    WorkerStats::Add(stats.*counter, n);
+    if (pStage != nullptr) WorkerStats::Add(pStage->stats.*counter, n);
+  }
+  inline void RecordLatency(uint64_t us) {
+    latency.Record(us);
+    if (pStage != nullptr) pStage->latency.Record(us);
+  }
+
+  void UpdateStage(chrono::steady_clock::time_point now);
+  bool Finished(chrono::steady_clock::time_point now);
+  bool Take(chrono::steady_clock::time_point now);
+  uint32_t TargetConnections(chrono::steady_clock::time_point now);
+  double TargetRate(chrono::steady_clock::time_point now);
+  void Snapshot(ThreadResult* pThreadResult);
+};
+
+// 报告线程，定时读取每个线程的统计快照，工作线程不需要加锁
+class Reporter {
+ private:
+  vector<Worker>& workers;
+  chrono::milliseconds interval;
+  chrono::steady_clock::time_point startTime;
+  chrono::steady_clock::time_point lastTime;
+
+  vector<Histogram> prevLatency;
+  Histogram snapshot;
+  Histogram diff;
+  uint64_t prevRequested{0};
+  uint64_t prevSuccess{0};
+  uint64_t prevError{0};
+  size_t prevRespData{0};
+
+  mutex mtx;
+  condition_variable cv;
+  bool stopped{false};
+  thread hThread;
+
+  void Tick(chrono::steady_clock::time_point now);
+
+ public:
+  IntervalCallback onInterval;
+  vector<IntervalSnapshot> series;
+
+  Reporter(vector<Worker>& workers, chrono::milliseconds interval);
+  void Start(chrono::steady_clock::time_point startTime);
+  // 停止并统计最后不满一个 interval 的部分
+  void Stop();
 };
 
-void blockHttpSend(Request* pRequest, LuaScript* pLuaScript);
-int run(Request* pRequest, RunResult* pResult);
+void blockHttpSend(Worker* pWorker);
+void multiHttpSend(Worker* pWorker);
+void rateHttpSend(Worker* pWorker);
+int run(Request* pRequest, RunResult* pResult,
+        IntervalCallback onInterval = nullptr);
+// 流式写出 json 结果，不会在内存里构建整个文档
+void writeResultJson(ostream& out, Request* pRequest, RunResult* pResult);
 }  // namespace oo
@@ -2,6 +2,7 @@
 #include <windows.h>
 #endif
 
+#include <fstream>
 #include <iostream>
 
 #include "oo.h"
@@ -16,14 +17,28 @@ int main(int argc, char* argv[]) {
   oo::Request request{argc, argv};
   oo::RunResult result;
 
-  if (oo::run(&request, &result)) {
+  auto printInterval = [](oo::IntervalSnapshot* pSnapshot) {
+    fprintf(stdout,
+            "[%7.1Fs] %10.1F/s | 失败 %5.2F%% | %8.1FKB/s | 50%% %8.2Fms | "
+            "99%% %8.2Fms\n",
+            pSnapshot->time.count() / 1000.0, pSnapshot->Rps(),
+            pSnapshot->ErrorRate() * 100, pSnapshot->BytesPerSecond() / 1024,
+            pSnapshot->p50 / 1000.0, pSnapshot->p99 / 1000.0);
+    fflush(stdout);
+  };
+
+  if (oo::run(&request, &result, printInterval)) {
     std::cerr << "Error: run" << std::endl;
     return 1;
   }
 
   if (!result.hasRunDone) {
     fprintf(stdout, "总耗时: %.2Fs\n", result.time.count() / (double)1000.0);
+    if (result.setupTime.count() >= 1000)
+      fprintf(stdout, "准备耗时: %.2Fms\n", result.setupTime.count() / 1000.0);
     std::cout << "线程数: " << result.threadCount << "\n";
+    if (result.connectionCount)
+      std::cout << "连接数: " << result.connectionCount << "\n";
     fprintf(stdout, "返回字节总数: %zd\n", result.respDataCount);
 
     if (result.successCount)
@@ -35,6 +50,108 @@ int main(int argc, char* argv[]) {
       fprintf(
           stdout, "失败: %d | %.1F%%\n", result.errorCount,
           ((double)result.errorCount / (double)result.requestedCount) * 100);
+
+    if (result.rate > 0)
+      fprintf(stdout, "计划速率: %.1F/s | 实际: %.1F/s | 延后: %llu | 丢弃: %llu\n",
+              result.rate,
+              result.time.count()
+                  ? result.requestedCount * 1000.0 / result.time.count()
+                  : 0,
+              (unsigned long long)result.lateCount,
+              (unsigned long long)result.droppedCount);
+
+    // 调度滞后高说明是 oo 自己没跟上计划，不是服务器慢
+    if (result.scheduleLag.TotalCount()) {
+      auto& h = result.scheduleLag;
+      fprintf(stdout, "调度滞后: 50%% %.2Fms | 99%% %.2Fms | 最大 %.2Fms",
+              h.Percentile(50) / 1000.0, h.Percentile(99) / 1000.0,
+              h.Max() / 1000.0);
+      if (result.rate <= 0)
+        fprintf(stdout, " | 延后: %llu | 丢弃: %llu",
+                (unsigned long long)result.lateCount,
+                (unsigned long long)result.droppedCount);
+      fprintf(stdout, "\n");
+    }
+
+    if (result.latency.TotalCount()) {
+      auto& h = result.latency;
+      fprintf(stdout, "延迟: 平均 %.2Fms | 标准差 %.2Fms | 最大 %.2Fms\n",
+              h.Mean() / 1000, h.Stdev() / 1000, h.Max() / 1000.0);
+      for (double p : {50.0, 75.0, 90.0, 99.0, 99.9, 99.99})
+        fprintf(stdout, "  %6g%% %10.2Fms\n", p, h.Percentile(p) / 1000.0);
+    }
+
+    if (result.luaTime.count() || result.gcTime.count())
+      fprintf(stdout, "lua: Response %.2Fms | 手动 GC %.2Fms | 内存 %zdKB\n",
+              result.luaTime.count() / 1000.0, result.gcTime.count() / 1000.0,
+              result.luaMemoryKB);
+
+    if (!result.statusCounts.empty()) {
+      std::cout << "状态码:";
+      for (auto&& [code, count] : result.statusCounts)
+        std::cout << " " << code << " x " << count;
+      std::cout << "\n";
+    }
+
+    if (result.phases.total.TotalCount()) {
+      fprintf(stdout, "新建连接: %llu | 复用: %llu\n",
+              (unsigned long long)result.connectCount,
+              (unsigned long long)(result.phases.total.TotalCount() -
+                                   result.phases.connect.TotalCount()));
+      fprintf(stdout, "  %-12s %10s %10s %10s %10s\n", "阶段(ms)", "平均",
+              "50%", "99%", "最大");
+      for (auto&& [name, pHistogram] : result.phases.Items()) {
+        if (!pHistogram->TotalCount()) continue;
+        fprintf(stdout, "  %-12s %10.3F %10.3F %10.3F %10.3F\n", name,
+                pHistogram->Mean() / 1000, pHistogram->Percentile(50) / 1000.0,
+                pHistogram->Percentile(99) / 1000.0,
+                pHistogram->Max() / 1000.0);
+      }
+    }
+
+    for (size_t i = 0; i < result.stages.size(); i++) {
+      auto& it = result.stages[i];
+      fprintf(stdout,
+              "  阶段%zd: %.1Fs 目标 %g | 请求 %llu | 失败 %llu | %.1F/s | 50%% "
+              "%.2Fms | 99%% %.2Fms\n",
+              i, it.duration.count() / 1000.0, it.target,
+              (unsigned long long)it.requestedCount,
+              (unsigned long long)it.errorCount, it.Rps(),
+              it.latency.Percentile(50) / 1000.0,
+              it.latency.Percentile(99) / 1000.0);
+    }
+
+    if (result.threads.size() > 1) {
+      for (size_t i = 0; i < result.threads.size(); i++) {
+        auto& it = result.threads[i];
+        fprintf(stdout, "  线程%zd: 请求 %d | 成功 %d | 失败 %d | %.1F/s", i,
+                it.requestedCount, it.successCount, it.errorCount, it.Rps());
+        if (it.cpu >= 0) fprintf(stdout, " | cpu %d", it.cpu);
+        if (it.setupTime.count() >= 1000)
+          fprintf(stdout, " | 准备 %.2Fms", it.setupTime.count() / 1000.0);
+        fprintf(stdout, "\n");
+      }
+    }
+  }
+
+  if (!request.hdrPath.empty()) {
+    FILE* file = fopen(std::string(request.hdrPath).c_str(), "w");
+    if (!file) {
+      std::cerr << "Error: open file " << request.hdrPath << std::endl;
+      return 1;
+    }
+    // 单位毫秒
+    result.latency.WritePercentiles(file, 1000.0);
+    fclose(file);
+  }
+
+  if (!request.outPath.empty()) {
+    std::ofstream out{std::string(request.outPath)};
+    if (!out) {
+      std::cerr << "Error: open file " << request.outPath << std::endl;
+      return 1;
+    }
+    oo::writeResultJson(out, &request, &result);
   }
 
   return 0;